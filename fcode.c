@@ -0,0 +1,388 @@
+/*
+ * Front coded name lists, for registrations on the wire and for the
+ * names a node holds in the registry.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "fcode.h"
+
+/*
+ * Appends a number, 7 bits a byte, low bits first
+ */
+static void put_varint( GByteArray *data, guint value ){
+  guint8 byte;
+
+  while ( value >= 0x80 ){
+    byte = (value & 0x7f) | 0x80;
+    g_byte_array_append( data, &byte, 1 );
+    value >>= 7;
+  }
+  byte = value;
+  g_byte_array_append( data, &byte, 1 );
+}
+
+static const guint8 *get_varint( const guint8 *p, guint *value ){
+  int shift = 0;
+
+  *value = 0;
+  do {
+    *value |= (guint)(*p & 0x7f) << shift;
+    shift += 7;
+  } while ( *p++ & 0x80 );
+  return p;
+}
+
+/*
+ * @return length of the prefix two names share
+ */
+guint fc_shared( const char *a, const char *b ){
+  guint i = 0;
+
+  while ( a[i] != '\0' && a[i] == b[i] )
+    ++i;
+  return i;
+}
+
+/*
+ * @return an empty list, see fc_append()
+ */
+struct fc_list *fc_new( void ){
+  struct fc_list *list = g_new0( struct fc_list, 1 );
+
+  list->data   = g_byte_array_new();
+  list->blocks = g_array_new( FALSE, FALSE, sizeof(guint32) );
+  return list;
+}
+
+/*
+ * Adds a name at the end of a list
+ *
+ * @param list    the list
+ * @param last    the last name of the list, replaced by this one
+ * @param name    the name, sorted after last
+ * @param length  strlen( name )
+ */
+void fc_append( struct fc_list *list, GString *last, const char *name, guint length ){
+  guint shared = 0;
+
+  if ( list->count % FC_RESTART == 0 ) {
+    guint32 offset = list->data->len;
+    g_array_append_val( list->blocks, offset );
+  } else {
+    while ( shared < last->len && shared < length && last->str[shared] == name[shared] )
+      ++shared;
+  }
+
+  put_varint( list->data, shared );
+  put_varint( list->data, length - shared );
+  g_byte_array_append( list->data, (const guint8*)name + shared, length - shared );
+  list->count ++;
+
+  g_string_truncate( last, shared );
+  g_string_append_len( last, name + shared, length - shared );
+}
+
+/*
+ * Front codes a list of names
+ *
+ * @param names  the names, sorted with strcmp
+ * @param count  number of names
+ */
+struct fc_list *fc_build( const char * const *names, guint count ){
+  struct fc_list *list = fc_new();
+  GString *last = g_string_sized_new( 256 );
+  guint i;
+
+  for ( i = 0; i < count; ++i )
+    fc_append( list, last, names[i], strlen( names[i] ) );
+
+  g_string_free( last, TRUE );
+  return list;
+}
+
+void fc_free( struct fc_list *list ){
+  if ( list == NULL )
+    return;
+
+  g_byte_array_free( list->data, TRUE );
+  g_array_free( list->blocks, TRUE );
+  g_free( list );
+}
+
+/*
+ * @return memory the list takes
+ */
+gsize fc_bytes( const struct fc_list *list ){
+  if ( list == NULL )
+    return 0;
+  return sizeof(*list) + list->data->len + list->blocks->len * sizeof(guint32);
+}
+
+/*
+ * Decodes the entry at p on top of the name before it
+ *
+ * @return the next entry
+ */
+static const guint8 *decode( const guint8 *p, GString *name ){
+  guint shared, length;
+
+  p = get_varint( p, &shared );
+  p = get_varint( p, &length );
+  g_string_truncate( name, shared );
+  g_string_append_len( name, (const char*)p, length );
+  return p + length;
+}
+
+/*
+ * Decodes a name
+ *
+ * @param list   the list
+ * @param index  which name, below list->count
+ * @param out    gets the name
+ */
+void fc_get( const struct fc_list *list, guint index, GString *out ){
+  guint block = index / FC_RESTART;
+  const guint8 *p = list->data->data + g_array_index( list->blocks, guint32, block );
+  guint i;
+
+  g_string_truncate( out, 0 );
+  for ( i = block * FC_RESTART; i <= index; ++i )
+    p = decode( p, out );
+}
+
+/*
+ * Steps over the entry at p comparing it with a name in place. match is
+ * the length of the prefix the entry before had in common with the name
+ * and cmp how it compared; an entry that shares more than match with it
+ * compares the same way.
+ *
+ * @param p      the entry
+ * @param name   the name
+ * @param size   strlen( name )
+ * @param match  prefix in common, updated
+ * @param cmp    <0, 0 or >0 as the entry is before, is or is after the name, updated
+ *
+ * @return the next entry
+ */
+static const guint8 *compare_next( const guint8 *p, const char *name, gsize size, guint *match, int *cmp ){
+  guint shared, length, i = 0;
+
+  p = get_varint( p, &shared );
+  p = get_varint( p, &length );
+  if ( shared > *match )
+    return p + length;
+
+  while ( i < length && shared + i < size && p[i] == (guint8)name[shared + i] )
+    ++i;
+  *match = shared + i;
+
+  if ( i < length && shared + i < size )
+    *cmp = p[i] < (guint8)name[shared + i] ? -1 : 1;
+  else if ( i < length )
+    *cmp = 1;
+  else
+    *cmp = shared + i < size ? -1 : 0;
+  return p + length;
+}
+
+/*
+ * Compares a name with the one in the list, without decoding it
+ *
+ * @param list   the list
+ * @param index  which name, below list->count
+ * @param name   the name
+ *
+ * @return true if they are the same
+ */
+bool fc_equal( const struct fc_list *list, guint index, const char *name ){
+  guint block = index / FC_RESTART;
+  const guint8 *p = list->data->data + g_array_index( list->blocks, guint32, block );
+  gsize size = strlen( name );
+  guint i, match = 0;
+  int cmp = 0;
+
+  for ( i = block * FC_RESTART; i <= index; ++i )
+    p = compare_next( p, name, size, &match, &cmp );
+  return cmp == 0;
+}
+
+/*
+ * Compares a block head, stored whole, with a name
+ */
+static int compare_head( const struct fc_list *list, guint block, const char *name ){
+  const guint8 *p = list->data->data + g_array_index( list->blocks, guint32, block );
+  guint shared, length;
+  size_t other = strlen( name );
+  int res;
+
+  p = get_varint( p, &shared );
+  p = get_varint( p, &length );
+  res = memcmp( p, name, MIN( length, other ) );
+  if ( res != 0 )
+    return res;
+  return length < other ? -1 : length > other;
+}
+
+/*
+ * Finds the first name that is not before a name, a binary search over
+ * the block heads and a scan of one block that compares in place
+ *
+ * @param list  the list, not empty
+ * @param name  the name
+ * @param cmp   0 if the name found is the one we looked for
+ *
+ * @return its index, list->count if every name is before it
+ */
+static guint lower_bound( const struct fc_list *list, const char *name, int *cmp ){
+  guint lo = 0, hi, i, end, match = 0;
+  const guint8 *p;
+  gsize size;
+
+  // Last block whose head is not after the name
+  hi = list->blocks->len;
+  while ( lo < hi ){
+    guint mid = (lo + hi) / 2;
+    if ( compare_head( list, mid, name ) <= 0 )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *cmp = 1;
+  if ( lo == 0 )
+    return 0;
+
+  size = strlen( name );
+  p    = list->data->data + g_array_index( list->blocks, guint32, lo - 1 );
+  end  = MIN( lo * FC_RESTART, list->count );
+  for ( i = (lo - 1) * FC_RESTART; i < end; ++i ){
+    p = compare_next( p, name, size, &match, cmp );
+    if ( *cmp >= 0 )
+      return i;
+  }
+
+  *cmp = 1;
+  return end;
+}
+
+/*
+ * Looks a name up
+ *
+ * @param list  the list
+ * @param name  the name
+ *
+ * @return its index, -1 if the list doesn't have it
+ */
+gint fc_find( const struct fc_list *list, const char *name ){
+  guint index;
+  int cmp;
+
+  if ( list == NULL || list->count == 0 )
+    return -1;
+
+  index = lower_bound( list, name, &cmp );
+  return cmp == 0 ? (gint)index : -1;
+}
+
+/*
+ * Finds where the names after a name start, e.g. to carry on through a
+ * list that was replaced since
+ *
+ * @param list  the list
+ * @param name  the name, the list doesn't need to have it
+ *
+ * @return index of the first name after it, list->count if there is none
+ */
+guint fc_upper( const struct fc_list *list, const char *name ){
+  guint index;
+  int cmp;
+
+  if ( list == NULL || list->count == 0 )
+    return 0;
+
+  index = lower_bound( list, name, &cmp );
+  return cmp == 0 ? index + 1 : index;
+}
+
+/*
+ * Starts decoding a list at a name, the names before it in its block are
+ * decoded on the way
+ *
+ * @param iter   the iterator
+ * @param list   the list, NULL for an empty one
+ * @param index  the first name fc_iter_next() decodes
+ * @param name   gets the names
+ */
+void fc_iter_init( struct fc_iter *iter, const struct fc_list *list, guint index, GString *name ){
+  guint i;
+
+  iter->list  = list;
+  iter->index = index;
+  iter->name  = name;
+  iter->p     = NULL;
+  g_string_truncate( name, 0 );
+
+  if ( list == NULL || index >= list->count )
+    return;
+
+  iter->p = list->data->data + g_array_index( list->blocks, guint32, index / FC_RESTART );
+  for ( i = index / FC_RESTART * FC_RESTART; i < index; ++i )
+    iter->p = decode( iter->p, name );
+}
+
+/*
+ * Decodes the next name into the name of the iterator
+ *
+ * @return false at the end of the list
+ */
+bool fc_iter_next( struct fc_iter *iter ){
+  if ( iter->list == NULL || iter->index >= iter->list->count )
+    return false;
+
+  iter->p = decode( iter->p, iter->name );
+  iter->index ++;
+  return true;
+}
+
+/*
+ * Appends a name to a front coded registration as "<shared>\t<suffix>\n".
+ * Every FC_RESTART-th line shares nothing, so a receiver can check it is
+ * still in step.
+ *
+ * @param out       the registration
+ * @param previous  the name sent before, NULL for the first one
+ * @param name      the name, sorted after previous
+ * @param index     how many names were sent before
+ */
+void fc_encode_line( GString *out, const char *previous, const char *name, guint index ){
+  guint shared = 0;
+
+  if ( previous != NULL && index % FC_RESTART != 0 )
+    shared = fc_shared( previous, name );
+
+  g_string_append_printf( out, "%u\t%s\n", shared, name + shared );
+}
+
+/*
+ * Decodes a line of a front coded registration
+ *
+ * @param previous  the name before, replaced by the decoded one
+ * @param line      the line without its newline
+ *
+ * @return false if the line is malformed
+ */
+bool fc_decode_line( GString *previous, const char *line ){
+  char *tab;
+  unsigned long shared = strtoul( line, &tab, 10 );
+
+  if ( tab == line || *tab != '\t' || shared > previous->len )
+    return false;
+
+  g_string_truncate( previous, shared );
+  g_string_append( previous, tab + 1 );
+  return true;
+}
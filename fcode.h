@@ -0,0 +1,63 @@
+/*
+ * Front coding of sorted name lists. Every name is stored as the length
+ * of the prefix it shares with the name before it plus the rest of it,
+ * every FC_RESTART-th name is stored whole so a list can be searched by
+ * its block heads and decoded a block at a time.
+ */
+#ifndef FCODE_H
+#define FCODE_H
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#define FC_RESTART  16
+
+/* First line of a front coded registration, see fc_encode_line() */
+#define FC_DIRECTIVE "!fc"
+
+/*
+ * A sorted, front coded list of names
+ *
+ * @param data    varint shared length, varint suffix length, suffix bytes
+ * @param blocks  guint32 offset in data of every FC_RESTART-th name
+ * @param count   number of names
+ */
+struct fc_list {
+  GByteArray  *data;
+  GArray      *blocks;
+  guint        count;
+};
+
+/*
+ * Decodes a list one name after the other, see fc_iter_init()
+ *
+ * @param index  the name fc_iter_next() decodes next
+ * @param p      where it starts in the data of the list
+ * @param name   gets the names
+ */
+struct fc_iter {
+  const struct fc_list *list;
+  guint        index;
+  const guint8 *p;
+  GString     *name;
+};
+
+guint fc_shared( const char *a, const char *b );
+
+struct fc_list *fc_new( void );
+void fc_append( struct fc_list *list, GString *last, const char *name, guint length );
+struct fc_list *fc_build( const char * const *names, guint count );
+void fc_free( struct fc_list *list );
+gsize fc_bytes( const struct fc_list *list );
+void fc_get( const struct fc_list *list, guint index, GString *out );
+bool fc_equal( const struct fc_list *list, guint index, const char *name );
+gint fc_find( const struct fc_list *list, const char *name );
+guint fc_upper( const struct fc_list *list, const char *name );
+void fc_iter_init( struct fc_iter *iter, const struct fc_list *list, guint index, GString *name );
+bool fc_iter_next( struct fc_iter *iter );
+
+void fc_encode_line( GString *out, const char *previous, const char *name, guint index );
+bool fc_decode_line( GString *previous, const char *line );
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Count-min sketch with a small list of heavy hitters on top
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "hot.h"
+#include "scan.h"
+
+static void free_item( gpointer data ){
+  struct hot_item *item = data;
+  g_free( item->name );
+  g_free( item );
+}
+
+/*
+ * Sets up an empty tracker
+ *
+ * @param hot   the tracker
+ * @param size  how many heavy hitters we keep by name
+ */
+void hot_init( struct hot_tracker *hot, guint size ){
+  memset( hot, 0, sizeof(*hot) );
+  hot->size  = size;
+  hot->top   = g_ptr_array_new_with_free_func( free_item );
+  hot->index = g_hash_table_new( g_str_hash, g_str_equal );
+  hot->next_decay = g_get_monotonic_time() + (gint64)HOT_DECAY * G_USEC_PER_SEC;
+}
+
+void hot_clear( struct hot_tracker *hot ){
+  g_hash_table_destroy( hot->index );
+  g_ptr_array_free( hot->top, TRUE );
+}
+
+/*
+ * Counts a name, every row gets its own counter from two halves of one
+ * hash (Kirsch-Mitzenmacher)
+ *
+ * @param hot   the tracker
+ * @param name  the name somebody asked for
+ *
+ * @return the estimate of how often it was asked for
+ */
+guint32 hot_add( struct hot_tracker *hot, const char *name ){
+  guint64 hash = scan_hash( name, strlen( name ) );
+  guint32 h1 = (guint32)hash, h2 = (guint32)(hash >> 32) | 1;
+  guint32 estimate = G_MAXUINT32;
+  struct hot_item *item, *least = NULL;
+  guint i;
+
+  hot->total ++;
+  for ( i = 0; i < HOT_DEPTH; ++i ){
+    guint32 *counter = &hot->counts[i][(h1 + i * h2) % HOT_WIDTH];
+    if ( *counter < G_MAXUINT32 )
+      ++*counter;
+    estimate = MIN( estimate, *counter );
+  }
+
+  if ( hot->size == 0 )
+    return estimate;
+
+  item = g_hash_table_lookup( hot->index, name );
+  if ( item != NULL ) {
+    item->count = estimate;
+    return estimate;
+  }
+
+  if ( hot->top->len >= hot->size ) {
+    // Take the place of the coldest one, if we beat it
+    for ( i = 0; i < hot->top->len; ++i ){
+      struct hot_item *other = g_ptr_array_index( hot->top, i );
+      if ( least == NULL || other->count < least->count )
+        least = other;
+    }
+    if ( least->count >= estimate )
+      return estimate;
+
+    g_hash_table_remove( hot->index, least->name );
+    g_ptr_array_remove_fast( hot->top, least );
+  }
+
+  item = g_new( struct hot_item, 1 );
+  item->name  = g_strdup( name );
+  item->count = estimate;
+  g_ptr_array_add( hot->top, item );
+  g_hash_table_insert( hot->index, item->name, item );
+
+  return estimate;
+}
+
+/*
+ * @return true if the name is one of the heavy hitters
+ */
+bool hot_contains( struct hot_tracker *hot, const char *name ){
+  return g_hash_table_contains( hot->index, name );
+}
+
+static gint compare_items( gconstpointer a, gconstpointer b ){
+  const struct hot_item *ia = *(const struct hot_item * const *)a;
+  const struct hot_item *ib = *(const struct hot_item * const *)b;
+  return ia->count > ib->count ? -1 : ia->count < ib->count;
+}
+
+/*
+ * @return the heavy hitters, hottest first, free with g_ptr_array_free,
+ *         the items stay with the tracker
+ */
+GPtrArray *hot_sorted( struct hot_tracker *hot ){
+  GPtrArray *sorted = g_ptr_array_sized_new( hot->top->len );
+  guint i;
+
+  for ( i = 0; i < hot->top->len; ++i )
+    g_ptr_array_add( sorted, g_ptr_array_index( hot->top, i ) );
+  g_ptr_array_sort( sorted, compare_items );
+  return sorted;
+}
+
+/*
+ * Halves every count when it is time, so names that cooled down make room
+ *
+ * @param hot  the tracker
+ * @param now  g_get_monotonic_time()
+ */
+void hot_decay( struct hot_tracker *hot, gint64 now ){
+  guint i, j;
+
+  if ( now < hot->next_decay )
+    return;
+  hot->next_decay = now + (gint64)HOT_DECAY * G_USEC_PER_SEC;
+
+  for ( i = 0; i < HOT_DEPTH; ++i )
+    for ( j = 0; j < HOT_WIDTH; ++j )
+      hot->counts[i][j] >>= 1;
+  for ( i = 0; i < hot->top->len; ++i )
+    ((struct hot_item*)g_ptr_array_index( hot->top, i ))->count >>= 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * Tracks which names are asked for the most, in fixed memory: a count-min
+ * sketch estimates how often every name was asked for and the few names
+ * with the highest estimates are kept by name. Counts are halved every
+ * HOT_DECAY seconds so the list follows what is hot right now.
+ */
+#ifndef HOT_H
+#define HOT_H
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#define HOT_DEPTH   4
+#define HOT_WIDTH   4096
+#define HOT_TOP     32
+#define HOT_DECAY   60
+
+/*
+ * A heavy hitter
+ *
+ * @param name   the name
+ * @param count  its estimate, never below the real count
+ */
+struct hot_item {
+  char        *name;
+  guint32      count;
+};
+
+/*
+ * @param counts      the sketch
+ * @param top         struct hot_item, at most size of them, in no order
+ * @param index       name -> struct hot_item of the ones in top
+ * @param total       names counted since the start
+ * @param next_decay  monotonic time of the next halving
+ */
+struct hot_tracker {
+  guint32      counts[HOT_DEPTH][HOT_WIDTH];
+  GPtrArray   *top;
+  GHashTable  *index;
+  guint        size;
+  guint64      total;
+  gint64       next_decay;
+};
+
+void hot_init( struct hot_tracker *hot, guint size );
+void hot_clear( struct hot_tracker *hot );
+guint32 hot_add( struct hot_tracker *hot, const char *name );
+bool hot_contains( struct hot_tracker *hot, const char *name );
+GPtrArray *hot_sorted( struct hot_tracker *hot );
+void hot_decay( struct hot_tracker *hot, gint64 now );
+
+#endif
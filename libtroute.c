@@ -0,0 +1,831 @@
+/*
+ * libtroute, the client side of the publishers: finds them, registers
+ * our names with the ones owning them and looks names up under /where.
+ */
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include <ccn/ccn.h>
+#include <ccn/uri.h>
+
+#include <glib.h>
+
+#include "troute.h"
+#include "ring.h"
+#include "fcode.h"
+
+/*
+ * A lookup on its way, freed once ccn is done with its closure
+ *
+ * @param answered  the callback already ran
+ */
+struct troute_lookup {
+  struct ccn_closure    closure;
+  struct troute        *tr;
+  char                 *name;
+  troute_callback       callback;
+  void                 *data;
+  bool                  answered;
+};
+
+/*
+ * Called with the answer to a lookup, the holders come one per line
+ */
+static enum ccn_upcall_res where_answer( struct ccn_closure *selfp,
+    enum ccn_upcall_kind kind, struct ccn_upcall_info *info )
+{
+  struct troute_lookup *lookup = selfp->data;
+  const unsigned char *buf;
+  size_t length;
+
+  switch (kind) {
+    case CCN_UPCALL_FINAL:
+      if ( !lookup->answered )
+        lookup->callback( lookup->tr, TROUTE_TIMEOUT, lookup->name, NULL, 0, lookup->data );
+      g_free( lookup->name );
+      g_free( lookup );
+      break;
+    case CCN_UPCALL_CONTENT:
+      if ( lookup->answered )
+        break;
+
+      ccn_content_get_value( info->content_ccnb, info->pco->offset[CCN_PCO_E], info->pco, &buf, &length );
+
+      char *body = g_strndup( (const char*)buf, length );
+      char **holders = g_strsplit( g_strstrip( body ), "\n", -1 );
+      guint count = body[0] != '\0' ? g_strv_length( holders ) : 0;
+
+      lookup->answered = true;
+      lookup->callback( lookup->tr, TROUTE_OK, lookup->name, count > 0 ? holders : NULL, count, lookup->data );
+
+      g_strfreev( holders );
+      g_free( body );
+      break;
+    case CCN_UPCALL_INTEREST_TIMED_OUT:
+      // Don't express it again, the caller decides
+      if ( !lookup->answered ) {
+        lookup->answered = true;
+        lookup->callback( lookup->tr, TROUTE_TIMEOUT, lookup->name, NULL, 0, lookup->data );
+      }
+      break;
+    default:
+      break;
+  }
+
+  return CCN_UPCALL_RESULT_OK;
+}
+
+/*
+ * Builds the Interest template for /where lookups. Answers are published
+ * under a version component, so we ask for the rightmost (latest) one
+ * right below the name we are looking for.
+ *
+ * @param tr holds the template
+ */
+static void create_where_template( struct troute *tr ){
+  struct ccn_charbuf *templ = ccn_charbuf_create();
+
+  ccn_charbuf_append_tt(templ, CCN_DTAG_Interest, CCN_DTAG);
+  ccn_charbuf_append_tt(templ, CCN_DTAG_Name, CCN_DTAG);
+  ccn_charbuf_append_closer(templ); /* </Name> */
+
+  // version + implicit digest
+  ccnb_tagged_putf(templ, CCN_DTAG_MinSuffixComponents, "%d", 2);
+  ccnb_tagged_putf(templ, CCN_DTAG_MaxSuffixComponents, "%d", 2);
+  ccnb_tagged_putf(templ, CCN_DTAG_ChildSelector, "%d", 1);
+  ccn_charbuf_append_closer(templ); /* </Interest> */
+
+  tr->template_where = templ;
+}
+
+/*
+ * A registration or a heartbeat on its way to a publisher. Connecting,
+ * sending and reading the answer all happen a bit at a time from
+ * troute_process().
+ *
+ * @param id         "host:port" of the publisher
+ * @param fd         the connection
+ * @param connected  connect() went through
+ * @param out        what we send, from offset on, the write side is shut once it is out
+ * @param reply      what the publisher answered so far
+ * @param heartbeat  only renews our lease, a RESYNC answer makes us send our names
+ * @param deadline   monotonic time we give up, moves whenever something moved
+ * @param next       registration for the same publisher that waits for this one
+ */
+struct troute_send {
+  char                 *id;
+  int                   fd;
+  bool                  connected;
+  GString              *out;
+  gsize                 offset;
+  bool                  shut;
+  GString              *reply;
+  bool                  heartbeat;
+  gint64                deadline;
+  GString              *next;
+};
+
+/* Bytes of the names command we read per troute_process() */
+#define NAMES_READ_BUDGET (1024*1024)
+
+/*
+ * Starts connecting to one of the publishers
+ *
+ * @param id  "host:port" of the publisher
+ *
+ * @return the socket, connecting, -1 if we couldn't even start
+ */
+static int connect_server( const char *id ){
+  struct sockaddr_in serv;
+  char host[NI_MAXHOST];
+  int port, fd;
+
+  memset( &serv, 0, sizeof(serv) );
+  if ( sscanf( id, "%1024[^:]:%d", host, &port ) != 2 || inet_aton( host, &serv.sin_addr ) == 0 )
+    return -1;
+
+  serv.sin_family = AF_INET;
+  serv.sin_port   = htons( port );
+  fd = socket(AF_INET,SOCK_STREAM,0);
+  if ( fd < 0 )
+    return -1;
+
+  fcntl( fd, F_SETFL, O_NONBLOCK );
+  if ( connect( fd, (struct sockaddr*)&serv, sizeof(serv) ) < 0 && errno != EINPROGRESS ){
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Tells the publisher how busy we are, so it can rank us against the
+ * other holders of a name
+ *
+ * @param out what we send
+ */
+static void append_load( GString *out ){
+  double load = 0;
+  long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+  getloadavg( &load, 1 );
+  g_string_append_printf( out, "!load %.2f %ld\n", load, cpus > 0 ? cpus : 1 );
+}
+
+static gint compare_names( gconstpointer a, gconstpointer b ){
+  return strcmp( *(const char * const *)a, *(const char * const *)b );
+}
+
+static void free_send( struct troute_send *job ){
+  close( job->fd );
+  g_free( job->id );
+  g_string_free( job->out, TRUE );
+  g_string_free( job->reply, TRUE );
+  if ( job->next != NULL )
+    g_string_free( job->next, TRUE );
+  g_free( job );
+}
+
+/*
+ * Starts sending something to a publisher. A heartbeat for a publisher
+ * we are already talking to is dropped, a registration waits for what is
+ * on its way there and replaces any that was waiting before it.
+ *
+ * @param tr         the resolver
+ * @param id         "host:port" of the publisher
+ * @param out        what we send, taken over
+ * @param heartbeat  it is only a heartbeat
+ */
+static void start_send( struct troute *tr, const char *id, GString *out, bool heartbeat ){
+  struct troute_send *job;
+  guint i;
+
+  for ( i = 0; i < tr->sends->len; ++i ){
+    job = g_ptr_array_index( tr->sends, i );
+    if ( strcmp( job->id, id ) != 0 )
+      continue;
+
+    if ( heartbeat ) {
+      g_string_free( out, TRUE );
+    } else {
+      if ( job->next != NULL )
+        g_string_free( job->next, TRUE );
+      job->next = out;
+    }
+    return;
+  }
+
+  job = g_new0( struct troute_send, 1 );
+  job->fd = connect_server( id );
+
+  // Whoever we knew may be gone, find out who is there
+  if ( job->fd < 0 ) {
+    g_string_free( out, TRUE );
+    g_free( job );
+    discovery_retry( &tr->discovery );
+    return;
+  }
+
+  job->id        = g_strdup( id );
+  job->out       = out;
+  job->reply     = g_string_new( NULL );
+  job->heartbeat = heartbeat;
+  job->deadline  = g_get_monotonic_time() + (gint64)TROUTE_SEND_TIMEOUT * G_USEC_PER_SEC;
+  g_ptr_array_add( tr->sends, job );
+}
+
+/*
+ * A names command failed, the publishers waiting for our names keep
+ * waiting and we try again in TROUTE_NAMES_RETRY seconds. Their lists
+ * stay as they are, we never send what a failed command printed.
+ *
+ * @param tr  the resolver
+ */
+static void names_failed( struct troute *tr ){
+  if ( tr->names_read != NULL )
+    g_string_free( tr->names_read, TRUE );
+  tr->names_read  = NULL;
+  tr->names_retry = g_get_monotonic_time() + (gint64)TROUTE_NAMES_RETRY * G_USEC_PER_SEC;
+}
+
+/*
+ * Starts the names command, unless it is running already or waits to be
+ * tried again
+ *
+ * @param tr  the resolver
+ */
+static void run_names( struct troute *tr ){
+  if ( tr->names_command == NULL || tr->names_read != NULL || g_get_monotonic_time() < tr->names_retry )
+    return;
+
+  tr->names_pipe = popen( tr->names_command, "r" );
+  if ( tr->names_pipe == NULL ) {
+    fprintf( stderr, "libtroute: could not run %s: %s\n", tr->names_command, strerror( errno ) );
+    names_failed( tr );
+    return;
+  }
+  fcntl( fileno( tr->names_pipe ), F_SETFL, O_NONBLOCK );
+  tr->names_read = g_string_new( NULL );
+}
+
+/*
+ * Runs the names command, unless it is running already, and sends a
+ * publisher its share of our names once it is done
+ *
+ * @param tr  the resolver
+ * @param id  "host:port" of the publisher, NULL for every one on the ring
+ */
+static void request_sync( struct troute *tr, const char *id ){
+  guint i;
+
+  if ( id == NULL )
+    tr->names_everybody = true;
+  else {
+    for ( i = 0; i < tr->names_pending->len; ++i )
+      if ( strcmp( g_ptr_array_index( tr->names_pending, i ), id ) == 0 )
+        break;
+    if ( i == tr->names_pending->len )
+      g_ptr_array_add( tr->names_pending, g_strdup( id ) );
+  }
+
+  run_names( tr );
+}
+
+/*
+ * Front codes the names that fall in the buckets a publisher owns, see
+ * fcode.h, followed by our load
+ *
+ * @param tr     the resolver
+ * @param id     "host:port" of the publisher
+ * @param names  all of our names, sorted
+ *
+ * @return the registration
+ */
+static GString *build_sync( struct troute *tr, const char *id, GPtrArray *names ){
+  GString *payload = g_string_new( FC_DIRECTIVE "\n" );
+  const char *previous = NULL;
+  guint i, sent = 0;
+
+  for ( i = 0; i < names->len; ++i ){
+    const char *name = g_ptr_array_index( names, i );
+    if ( strcmp( ring_owner( tr->discovery.ring, ring_bucket( name ) ), id ) != 0 )
+      continue;
+
+    fc_encode_line( payload, previous, name, sent++ );
+    previous = name;
+  }
+
+  append_load( payload );
+  return payload;
+}
+
+/*
+ * The names command is done, every publisher that waited for our names
+ * gets its share
+ *
+ * @param tr the resolver
+ */
+static void send_names( struct troute *tr ){
+  struct ring *ring = tr->discovery.ring;
+  GPtrArray *names = g_ptr_array_new();
+  char *line = tr->names_read->str;
+  guint i;
+
+  while ( *line != '\0' ){
+    char *nl = strchr( line, '\n' );
+    if ( nl != NULL )
+      *nl = '\0';
+    if ( line[0] != '\0' )
+      g_ptr_array_add( names, line );
+    if ( nl == NULL )
+      break;
+    line = nl + 1;
+  }
+
+  // Sorted, so that every name shares as much as it can with the one before
+  g_ptr_array_sort( names, compare_names );
+
+  if ( ring != NULL && ring->members->len > 0 ) {
+    if ( tr->names_everybody ) {
+      for ( i = 0; i < ring->members->len; ++i ){
+        const char *id = g_ptr_array_index( ring->members, i );
+        start_send( tr, id, build_sync( tr, id, names ), false );
+      }
+    } else {
+      for ( i = 0; i < tr->names_pending->len; ++i ){
+        const char *id = g_ptr_array_index( tr->names_pending, i );
+        start_send( tr, id, build_sync( tr, id, names ), false );
+      }
+    }
+  }
+
+  tr->names_everybody = false;
+  g_ptr_array_set_size( tr->names_pending, 0 );
+  g_ptr_array_free( names, TRUE );
+  g_string_free( tr->names_read, TRUE );
+  tr->names_read = NULL;
+}
+
+/*
+ * Reads what the names command printed so far, at most NAMES_READ_BUDGET
+ * bytes. Once it is done its names go out, if it exited with 0.
+ *
+ * @param tr the resolver
+ */
+static void read_names( struct troute *tr ){
+  char buffer[64*1024];
+  gsize budget = NAMES_READ_BUDGET;
+  ssize_t size = 0;
+  int status;
+
+  while ( budget > 0 && (size = read( fileno( tr->names_pipe ), buffer, sizeof(buffer) )) > 0 ){
+    g_string_append_len( tr->names_read, buffer, size );
+    budget -= MIN( budget, (gsize)size );
+  }
+  if ( budget == 0 || (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) )
+    return;
+
+  // Cut short or failed, sending it would take names away from the publishers
+  status = pclose( tr->names_pipe );
+  tr->names_pipe = NULL;
+  if ( size < 0 || status == -1 || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ) {
+    fprintf( stderr, "libtroute: %s failed (status %d), trying again in %d s\n",
+        tr->names_command, status, TROUTE_NAMES_RETRY );
+    names_failed( tr );
+    return;
+  }
+
+  send_names( tr );
+}
+
+/*
+ * Takes in the answer of a publisher, "OK <lease>" or "RESYNC" if it
+ * forgot about us
+ *
+ * @param tr   gets the lease
+ * @param job  what we sent
+ */
+static void take_reply( struct troute *tr, struct troute_send *job ){
+  if ( strncmp( job->reply->str, "RESYNC", 6 ) == 0 ) {
+    if ( job->heartbeat )
+      request_sync( tr, job->id );
+  } else if ( sscanf( job->reply->str, "OK %d", &tr->lease ) == 1 && tr->lease > 0 ) {
+    tr->next_heartbeat = g_get_monotonic_time() + (gint64)tr->lease * G_USEC_PER_SEC / 3;
+  }
+}
+
+/*
+ * Moves a send along as far as it goes without waiting: finishes the
+ * connect, writes, tells the publisher we are done and reads its answer
+ *
+ * @param tr   the resolver
+ * @param job  the send
+ * @param now  monotonic time
+ *
+ * @return 0 while it is on its way, 1 once it is done, -1 if it failed
+ */
+static int step_send( struct troute *tr, struct troute_send *job, gint64 now ){
+  char buffer[256];
+  ssize_t size;
+
+  if ( !job->connected ) {
+    struct pollfd pfd = { .fd = job->fd, .events = POLLOUT };
+    socklen_t length = sizeof(int);
+    int error = 0;
+
+    if ( poll( &pfd, 1, 0 ) == 0 )
+      return now < job->deadline ? 0 : -1;
+    if ( getsockopt( job->fd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 || error != 0 )
+      return -1;
+    job->connected = true;
+  }
+
+  while ( job->offset < job->out->len ){
+    size = send( job->fd, job->out->str + job->offset, job->out->len - job->offset, MSG_NOSIGNAL );
+    if ( size < 0 )
+      return (errno == EAGAIN || errno == EWOULDBLOCK) && now < job->deadline ? 0 : -1;
+    job->offset  += size;
+    job->deadline = now + (gint64)TROUTE_SEND_TIMEOUT * G_USEC_PER_SEC;
+  }
+
+  if ( !job->shut ) {
+    shutdown( job->fd, SHUT_WR );
+    job->shut = true;
+  }
+
+  while ( (size = recv( job->fd, buffer, sizeof(buffer), 0 )) > 0 ){
+    g_string_append_len( job->reply, buffer, size );
+    job->deadline = now + (gint64)TROUTE_SEND_TIMEOUT * G_USEC_PER_SEC;
+  }
+  if ( size < 0 )
+    return (errno == EAGAIN || errno == EWOULDBLOCK) && now < job->deadline ? 0 : -1;
+
+  take_reply( tr, job );
+  return 1;
+}
+
+/*
+ * Moves every send along, whatever waited for a finished one goes next
+ *
+ * @param tr the resolver
+ */
+static void run_sends( struct troute *tr ){
+  gint64 now = g_get_monotonic_time();
+  guint i = tr->sends->len;
+
+  // Backwards, sends that start here go at the end and wait for the next call
+  while ( i-- > 0 ){
+    struct troute_send *job = g_ptr_array_index( tr->sends, i );
+    GString *next;
+    int res = step_send( tr, job, now );
+
+    if ( res == 0 )
+      continue;
+
+    // Whoever we knew may be gone, find out who is there
+    if ( res < 0 )
+      discovery_retry( &tr->discovery );
+
+    g_ptr_array_remove_index_fast( tr->sends, i );
+    next = job->next;
+    job->next = NULL;
+    if ( next != NULL )
+      start_send( tr, job->id, next, false );
+    free_send( job );
+  }
+}
+
+/*
+ * Renews our lease with every publisher we aren't talking to already, a
+ * publisher that forgot us gets everything again
+ *
+ * @param tr the resolver
+ */
+static void send_heartbeat( struct troute *tr ){
+  struct ring *ring = tr->discovery.ring;
+  guint i;
+
+  tr->next_heartbeat = g_get_monotonic_time() + (gint64)tr->lease * G_USEC_PER_SEC / 3;
+
+  for ( i = 0; ring != NULL && i < ring->members->len; ++i ){
+    GString *out = g_string_new( "!heartbeat\n" );
+
+    append_load( out );
+    start_send( tr, g_ptr_array_index( ring->members, i ), out, true );
+  }
+}
+
+/*
+ * Saves the publishers we know, with the time we saved them, so the next
+ * start can register right away. The file is replaced as a whole.
+ *
+ * @param tr the resolver
+ */
+static void save_cache( struct troute *tr ){
+  struct ring *ring = tr->discovery.ring;
+  GString *contents;
+  GError *error = NULL;
+  guint i;
+
+  if ( tr->cache_path == NULL || ring == NULL )
+    return;
+
+  contents = g_string_new( NULL );
+  g_string_append_printf( contents, "%" G_GINT64_FORMAT "\n", g_get_real_time() / G_USEC_PER_SEC );
+  for ( i = 0; i < ring->members->len; ++i )
+    g_string_append_printf( contents, "%s\n", (char*)g_ptr_array_index( ring->members, i ) );
+
+  if ( !g_file_set_contents( tr->cache_path, contents->str, contents->len, &error ) ) {
+    fprintf( stderr, "libtroute: can't save %s: %s\n", tr->cache_path, error->message );
+    g_error_free( error );
+  }
+  g_string_free( contents, TRUE );
+}
+
+/*
+ * The set of publishers changed, the buckets moved so everybody gets
+ * their share again
+ */
+static void ring_changed( struct ring_discovery *disc, void *data ){
+  struct troute *tr = data;
+  tr->resync = true;
+}
+
+/*
+ * A discovery round found the publishers, save them with the time we
+ * last saw them even when they are the ones we had
+ */
+static void ring_confirmed( struct ring_discovery *disc, void *data ){
+  save_cache( data );
+}
+
+/*
+ * Starts from the publishers an earlier run saved, if there are any.
+ * They are used right away; if they were saved less than
+ * TROUTE_CACHE_FRESH seconds ago discovery checks on them later, with
+ * jitter, otherwise right away. Whatever discovery finds is saved back.
+ *
+ * @param tr    the resolver
+ * @param path  the file, NULL to stop saving
+ *
+ * @return true if we got publishers out of it
+ */
+bool troute_set_cache( struct troute *tr, const char *path ){
+  gchar *contents = NULL;
+  gchar **lines;
+  gint64 saved, age;
+
+  g_free( tr->cache_path );
+  tr->cache_path = path != NULL ? g_strdup( path ) : NULL;
+
+  if ( path == NULL || !g_file_get_contents( path, &contents, NULL, NULL ) )
+    return false;
+
+  lines = g_strsplit( g_strstrip( contents ), "\n", -1 );
+  g_free( contents );
+
+  if ( lines[0] == NULL || lines[1] == NULL ) {
+    g_strfreev( lines );
+    return false;
+  }
+
+  saved = g_ascii_strtoll( lines[0], NULL, 10 );
+  age = g_get_real_time() / G_USEC_PER_SEC - saved;
+
+  discovery_seed( &tr->discovery, lines + 1 );
+  if ( age >= 0 && age < TROUTE_CACHE_FRESH )
+    discovery_defer( &tr->discovery, (gint64)DISCOVERY_INTERVAL * G_USEC_PER_SEC );
+  tr->resync = true;
+
+  fprintf( stderr, "libtroute: %u publishers from %s, saved %" G_GINT64_FORMAT " s ago\n",
+      tr->discovery.ring->members->len, path, age );
+  g_strfreev( lines );
+  return true;
+}
+
+/*
+ * Creates a resolver and connects it to the local ccnd. Discovery of the
+ * publishers starts with the first troute_process().
+ *
+ * @param prefix  ccnx:/name/prefix the publishers answer under
+ *
+ * @return the resolver, NULL if the prefix is bad or ccnd isn't there
+ */
+struct troute *troute_new( const char *prefix ){
+  struct troute *tr = g_new0( struct troute, 1 );
+
+  tr->prefix_server = ccn_charbuf_create();
+  tr->prefix_where  = ccn_charbuf_create();
+
+  if ( ccn_name_from_uri( tr->prefix_server, prefix ) < 0 ||
+      ccn_name_from_uri( tr->prefix_where, prefix ) < 0 ||
+      ccn_name_append_str( tr->prefix_server, TROUTE_SERVER_SUFFIX ) < 0 ||
+      ccn_name_append_str( tr->prefix_where, TROUTE_WHERE_SUFFIX ) < 0 ) {
+    fprintf( stderr, "libtroute: bad ccn URI: %s\n", prefix );
+    troute_destroy( tr );
+    return NULL;
+  }
+
+  tr->ccn = ccn_create();
+  if ( ccn_connect( tr->ccn, NULL ) == -1 ) {
+    perror( "Could not connect to ccnd" );
+    troute_destroy( tr );
+    return NULL;
+  }
+
+  tr->sends = g_ptr_array_new();
+  tr->names_pending = g_ptr_array_new_with_free_func( g_free );
+
+  create_where_template( tr );
+  discovery_init( &tr->discovery, tr->ccn, tr->prefix_server, NULL, ring_changed, tr );
+  tr->discovery.confirmed = ring_confirmed;
+  return tr;
+}
+
+/*
+ * Frees a resolver, lookups still on their way time out
+ *
+ * @param tr the resolver
+ */
+void troute_destroy( struct troute *tr ){
+  if ( tr == NULL )
+    return;
+
+  if ( tr->ccn != NULL )
+    ccn_destroy( &tr->ccn );
+  while ( tr->sends != NULL && tr->sends->len > 0 )
+    free_send( g_ptr_array_remove_index_fast( tr->sends, tr->sends->len - 1 ) );
+  if ( tr->sends != NULL )
+    g_ptr_array_free( tr->sends, TRUE );
+  if ( tr->names_pending != NULL )
+    g_ptr_array_free( tr->names_pending, TRUE );
+  if ( tr->names_pipe != NULL )
+    pclose( tr->names_pipe );
+  if ( tr->names_read != NULL )
+    g_string_free( tr->names_read, TRUE );
+  ring_destroy( tr->discovery.ring );
+  ring_destroy( tr->discovery.next );
+  g_free( tr->discovery.self );
+
+  ccn_charbuf_destroy( &tr->prefix_server );
+  ccn_charbuf_destroy( &tr->prefix_where );
+  ccn_charbuf_destroy( &tr->template_where );
+  g_free( tr->names_command );
+  g_free( tr->cache_path );
+  g_free( tr );
+}
+
+/*
+ * Registers the names a command prints, one per line, with the publishers
+ * owning them, and keeps the lease alive
+ *
+ * @param tr       the resolver
+ * @param command  run with popen(), NULL to stop registering
+ */
+void troute_set_names_command( struct troute *tr, const char *command ){
+  g_free( tr->names_command );
+  tr->names_command = command != NULL ? g_strdup( command ) : NULL;
+  tr->resync = command != NULL;
+}
+
+/*
+ * @return the descriptor of ccnd, see troute_fds() for all of them
+ */
+int troute_fd( struct troute *tr ){
+  return ccn_get_connection_fd( tr->ccn );
+}
+
+/*
+ * Fills in the descriptors to poll() before the next troute_process():
+ * ccnd, the names command while it runs and every publisher we are
+ * talking to. Ones that don't fit still get served, just not any sooner
+ * than the timeout troute_process() returned.
+ *
+ * @param tr    the resolver
+ * @param fds   gets the descriptors and the events to wait for
+ * @param size  room in fds
+ *
+ * @return how many it filled in
+ */
+guint troute_fds( struct troute *tr, struct pollfd *fds, guint size ){
+  guint count = 0, i;
+
+  if ( count < size )
+    fds[count++] = (struct pollfd){ .fd = ccn_get_connection_fd( tr->ccn ), .events = POLLIN };
+  if ( tr->names_pipe != NULL && count < size )
+    fds[count++] = (struct pollfd){ .fd = fileno( tr->names_pipe ), .events = POLLIN };
+
+  for ( i = 0; i < tr->sends->len && count < size; ++i ){
+    struct troute_send *job = g_ptr_array_index( tr->sends, i );
+    bool writing = !job->connected || job->offset < job->out->len;
+
+    fds[count++] = (struct pollfd){ .fd = job->fd, .events = writing ? POLLOUT : POLLIN };
+  }
+
+  return count;
+}
+
+/*
+ * Does whatever is due without blocking: answers, discovery rounds,
+ * registrations and heartbeats. Registrations are TCP exchanges with the
+ * publishers that go on across calls, as does reading the names command.
+ *
+ * @param tr the resolver
+ *
+ * @return ms until it wants to be called again, at most TROUTE_MAX_WAIT
+ */
+int troute_process( struct troute *tr ){
+  gint64 now, wait = TROUTE_MAX_WAIT;
+
+  ccn_run( tr->ccn, 0 );
+  discovery_run( &tr->discovery );
+
+  if ( tr->names_command != NULL ) {
+    struct ring *ring = tr->discovery.ring;
+
+    if ( tr->resync && ring != NULL && ring->members->len > 0 ) {
+      tr->resync = false;
+      request_sync( tr, NULL );
+    }
+
+    // Publishers still wait for our names after the command failed
+    if ( tr->names_everybody || tr->names_pending->len > 0 )
+      run_names( tr );
+
+    if ( tr->lease > 0 && g_get_monotonic_time() >= tr->next_heartbeat )
+      send_heartbeat( tr );
+  }
+
+  if ( tr->names_read != NULL )
+    read_names( tr );
+  run_sends( tr );
+
+  now = g_get_monotonic_time();
+  if ( tr->names_command != NULL && tr->lease > 0 )
+    wait = CLAMP( (tr->next_heartbeat - now) / 1000, 0, TROUTE_MAX_WAIT );
+
+  return (int)wait;
+}
+
+/*
+ * Looks up who holds a name, the callback runs from troute_process()
+ * once a publisher answered or the Interest timed out
+ *
+ * @param tr        the resolver
+ * @param name      the name
+ * @param callback  gets the holders
+ * @param data      passed to callback
+ */
+void troute_lookup( struct troute *tr, const char *name, troute_callback callback, void *data ){
+  struct troute_lookup *lookup = g_new0( struct troute_lookup, 1 );
+  struct ccn_charbuf *interest = ccn_charbuf_create();
+  char bucket[8];
+
+  lookup->closure.p    = &where_answer;
+  lookup->closure.data = lookup;
+  lookup->tr       = tr;
+  lookup->name     = g_strdup( name );
+  lookup->callback = callback;
+  lookup->data     = data;
+
+  // The bucket routes the Interest to the publisher owning the name
+  snprintf( bucket, sizeof(bucket), RING_BUCKET_FORMAT, ring_bucket( name ) );
+
+  ccn_charbuf_append_charbuf( interest, tr->prefix_where );
+  ccn_name_append_str( interest, bucket );
+  ccn_name_append_str( interest, name );
+
+  // ccn owns the closure from here on, it gets CCN_UPCALL_FINAL either way
+  ccn_express_interest( tr->ccn, interest, &lookup->closure, tr->template_where );
+  ccn_charbuf_destroy( &interest );
+}
+
+/*
+ * Looks up many names at once, all Interests go out before any answer
+ * comes back. The callback runs once per name.
+ *
+ * @param tr        the resolver
+ * @param names     the names
+ * @param count     number of names
+ * @param callback  gets the holders of every name
+ * @param data      passed to callback
+ */
+void troute_lookup_batch( struct troute *tr, const char * const *names, guint count,
+    troute_callback callback, void *data ){
+  guint i;
+
+  for ( i = 0; i < count; ++i )
+    troute_lookup( tr, names[i], callback, data );
+}
@@ -18,6 +18,8 @@
 #include <assert.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
 
 #include <ccn/ccn.h>
 #include <ccn/uri.h>
@@ -30,16 +32,116 @@
 
 #include <glib.h>
 
-struct _GRelation
-{
-  gint fields;
-  gint current_field;
-  
-  GHashTable   *all_tuples;
-  GHashTable  **hashed_tuple_tables;
-  
-  gint count;
+#include "registry.h"
+#include "ring.h"
+#include "fcode.h"
+#include "hot.h"
+#include "replica.h"
+
+/*
+ * Counters dumped to stderr when the publisher receives SIGUSR1
+ *
+ * @param server_signed     /server answers we actually had to sign
+ * @param where_interests   /where Interests that we answered
+ * @param where_signed      /where answers we actually had to sign
+ * @param where_coalesced   /where Interests answered from an in-flight answer
+ * @param where_dropped     /where Interests we left unanswered, over a limit
+ * @param where_prewarmed   /where Interests answered with a pre-signed answer
+ * @param prewarm_signed    answers we pre-signed for hot names
+ * @param worst_latency     longest we kept ccnd waiting since the last dump (usec)
+ * @param conn_timeouts     connections we closed, nothing came for CONN_IDLE seconds
+ * @param conn_oversized    connections we closed, more than we buffer for one
+ */
+struct publisher_stats {
+    unsigned long       server_interests;
+    unsigned long       server_signed;
+    unsigned long       where_interests;
+    unsigned long       where_signed;
+    unsigned long       where_coalesced;
+    unsigned long       where_dropped;
+    unsigned long       where_prewarmed;
+    unsigned long       prewarm_signed;
+    gint64              worst_latency;
+    unsigned long       conn_timeouts;
+    unsigned long       conn_oversized;
+    unsigned long       takeovers;
+};
+
+/*
+ * An answer signed ahead of time for a hot name
+ *
+ * @param version  the version it went out under
+ * @param epoch    load_epoch of the registry when we ranked the holders
+ * @param data     the signed ContentObject
+ */
+struct prewarmed {
+    guint64             version;
+    guint64             epoch;
+    struct ccn_charbuf *data;
+};
+
+/*
+ * Token bucket, refilled at rate tokens per second up to burst
+ */
+struct token_limit {
+    double              rate;
+    double              burst;
+};
+
+struct token_bucket {
+    double              tokens;
+    gint64              refilled;
+};
+
+/*
+ * A source address sending us registrations, all its connections share
+ * one byte bucket
+ *
+ * @param read         bytes we read from it
+ * @param throttled    times we left its data in the socket, out of tokens
+ * @param connections  connections of it we are still reading
+ * @param refused      connections we closed right away, it had MAX_CONNECTIONS
+ */
+struct tcp_client {
+    char                addr[NI_MAXHOST];
+    struct token_bucket bytes;
+    guint64             read;
+    unsigned long       throttled;
+    guint               connections;
+    unsigned long       refused;
+};
+
+/*
+ * A node sending us its names or a heartbeat. We read it without blocking
+ * and only ingest it once it is complete, a part per tick.
+ *
+ * @param buffer     what we read so far, buffer[length] is writable
+ * @param active     monotonic time it last sent us something, or we held it back
+ * @param offset     how far we ingested it
+ * @param sync       the registry sync, while we are ingesting names
+ * @param heartbeat  the node only renews its lease
+ * @param previous   last name of a front coded registration, see fcode.h
+ */
+struct tcp_conn {
+    int                 fd;
+    char                addr[NI_MAXHOST];
+
+    struct tcp_client  *client;
+
+    char               *buffer;
+    size_t              length;
+    size_t              capacity;
+    gint64              active;
+    size_t              offset;
+
+    struct reg_sync    *sync;
+    bool                heartbeat;
+    GString            *previous;
+    bool                reported;
+    double              load;
+    double              cpus;
 };
+
 /*
  * Structure holding info about our server
  *
@@ -52,18 +154,78 @@ struct _GRelation
 struct ccn_info_server {
     struct ccn         *ccn;
 
-    /* Interests residing on /server path */
+    /* Interests residing on /server path, and our signed answer to them */
     struct ccn_closure  closure_server;
     struct ccn_charbuf *prefix_server;
+    struct ccn_charbuf *info_answer;
+    gint64              info_expires;
+
+    /*
+     * What every answer of a kind shares, built once by create_templates():
+     * signing parameters whose SignedInfo template carries the freshness
+     * and our key locator, the name of our /server answer, and the buffers
+     * /where answers are put together in
+     */
+    struct ccn_signing_params sp_server;
+    struct ccn_signing_params sp_held;
+    struct ccn_signing_params sp_unheld;
+    struct ccn_charbuf *server_name;
+    struct ccn_charbuf *answer_name;
+    GString            *answer_payload;
 
     /* Interests residing on /where path */
     struct ccn_closure  closure_where;
     struct ccn_charbuf *prefix_where;
+    int                 where_ncomps;
 
-    /* Table of relations */
-    GRelation   *relations;
+    /* Publishers sharing the name space with us, and the buckets we own */
+    struct ring_discovery discovery;
+    char                id[NI_MAXHOST+8];
+    bool                owned[RING_BUCKETS];
+
+    /* Which node holds which name */
+    struct registry    *registry;
+    int                 lease;
+    gsize               budget;
+
+    /*
+     * Replicas we ship the changes to our registry to, or as a replica the
+     * primary whose changes we apply. Replicas take no registrations, they
+     * answer /where for the buckets of their primary, and /server under its
+     * id while it is silent.
+     */
+    struct repl_primary replication;
+    struct repl_replica replica;
+    bool                is_replica;
+    bool                standing_in;
+
+    /* how we rank holders in /where answers */
+    int                 top_k;
+    bool                two_choices;
+
+    /* Signed /where answers of the current tick, keyed by Interest name */
+    GHashTable  *inflight;
+
+    /* The names asked for the most, and answers signed for them ahead of time */
+    struct hot_tracker  hot;
+    GHashTable         *prewarmed;
+
+    /*
+     * Admission control. Registration bytes are limited per source address.
+     * Interests carry no source, so they are limited overall and per name.
+     */
+    struct token_limit  register_limit;
+    struct token_limit  interest_limit;
+    struct token_limit  name_limit;
+    struct token_bucket interests;
+    GHashTable         *clients;
+    GHashTable         *names;
+    gint64              next_prune;
+
+    struct publisher_stats stats;
 
     int                 expire;
+    int                 expire_versioned;
     char                host[NI_MAXHOST];
     int                 port;
     int                 count;
@@ -71,11 +233,47 @@ struct ccn_info_server {
     /* tcp server stuff */
     int                 socket;
     struct sockaddr_in  serv;
+
+    /*
+     * connections still sending, and complete ones waiting to be ingested,
+     * with the bytes their buffers hold
+     */
+    GQueue              reading;
+    GQueue              ready;
+    gsize               buffered;
+
+    /*
+     * Ingestion gets a slice of every tick, the slice shrinks when ccnd
+     * waited longer than the latency target and grows back otherwise
+     */
+    gint64              latency_target;
+    gint64              slice;
+    double              ingest_rate;
+    gint64              served_at;
 };
 
 #define SERVER_SUFFIX "server"
 #define WHERE_SUFFIX  "where"
 #define BUF_SIZE      64*1024
+#define VERSIONED_EXPIRE 300
+#define LEASE         600
+#define RECLAIM_BUDGET 4096
+#define LATENCY_TARGET 20
+#define MIN_SLICE     500
+#define IDLE_TIMEOUT  50
+#define READ_BUDGET   (4*1024*1024)
+#define MIN_CHUNK     (16*1024)
+#define MAX_CHUNK     (64*1024*1024)
+#define REGISTER_RATE 16384
+#define INTEREST_RATE 20000
+#define NAME_RATE     100
+#define PREWARM_BUDGET 8
+#define MAX_CONNECTIONS 8
+#define CONN_IDLE     30
+#define MAX_BUFFERED  (1024*1024*1024)
+
+/* Set from the SIGUSR1 handler, the main loop dumps the stats */
+static volatile sig_atomic_t dump_stats_requested = 0;
 
 /*
  * Blurts out usage information
@@ -90,7 +288,19 @@ static void usage(const char *progname)
             " -h - print this message and exit\n"
             " -i - the interface we will be listening on\n"
             " -p - the port that our server would be listening on for incoming connections\n"
-            " -x - set FreshnessSeconds\n",
+            " -x - set FreshnessSeconds\n"
+            " -X - set FreshnessSeconds of versioned /where answers\n"
+            " -l - lease in seconds, nodes that don't renew it are dropped\n"
+            " -m - memory budget of the registry in MB, 0 for none\n"
+            " -k - return at most this many holders per /where answer\n"
+            " -r - rank holders with power of two random choices instead of sorting\n"
+            " -L - latency target in ms, registrations are ingested in slices that keep it\n"
+            " -B - registration KB/s we read from every source address, 0 for no limit\n"
+            " -q - /where Interests per second we answer, 0 for no limit\n"
+            " -Q - /where answers per second we sign for any one name, 0 for no limit\n"
+            " -H - track this many of the hottest names and sign their answers ahead, 0 to turn it off\n"
+            " -R - replicate the publisher at host:port and answer /where for its buckets, take no registrations\n"
+            " -A - let the replica at this ip address follow us, may be given more than once\n",
             progname);
     exit(1);
 }
@@ -145,6 +355,102 @@ void extract_ip(  const char *iface, struct ccn_info_server *server ){
   freeifaddrs(ifaddr);
 }
 
+/*
+ * Adds the tokens earned since the last refill
+ *
+ * @param bucket  the bucket
+ * @param limit   its rate and burst
+ * @param now     g_get_monotonic_time()
+ */
+static void bucket_refill( struct token_bucket *bucket, const struct token_limit *limit, gint64 now ){
+  bucket->tokens = MIN( limit->burst, bucket->tokens + (now - bucket->refilled) * limit->rate / G_USEC_PER_SEC );
+  bucket->refilled = now;
+}
+
+/*
+ * Takes tokens out of a bucket, a limit with no rate lets everything through
+ *
+ * @return false if there weren't enough
+ */
+static bool bucket_take( struct token_bucket *bucket, const struct token_limit *limit, double amount, gint64 now ){
+  if ( limit->rate <= 0 )
+    return true;
+
+  bucket_refill( bucket, limit, now );
+  if ( bucket->tokens < amount )
+    return false;
+
+  bucket->tokens -= amount;
+  return true;
+}
+
+/*
+ * @return a bucket that starts full
+ */
+static struct token_bucket bucket_full( const struct token_limit *limit, gint64 now ){
+  struct token_bucket bucket = { .tokens = limit->burst, .refilled = now };
+  return bucket;
+}
+
+/*
+ * Decides whether we answer a /where Interest at all. Everything counts
+ * against the overall limit, answers we would have to sign also against
+ * the limit of their name, signing is what costs us.
+ *
+ * @param server  holds the limits
+ * @param key     the Interest name, NULL if we answer from an in-flight answer
+ *
+ * @return false to drop the Interest
+ */
+static bool admit_interest( struct ccn_info_server *server, const char *key ){
+  gint64 now = g_get_monotonic_time();
+  struct token_bucket *bucket;
+
+  if ( !bucket_take( &server->interests, &server->interest_limit, 1, now ) )
+    return false;
+  if ( key == NULL || server->name_limit.rate <= 0 )
+    return true;
+
+  bucket = g_hash_table_lookup( server->names, key );
+  if ( bucket == NULL ) {
+    bucket = g_new( struct token_bucket, 1 );
+    *bucket = bucket_full( &server->name_limit, now );
+    g_hash_table_insert( server->names, g_strdup( key ), bucket );
+  }
+  return bucket_take( bucket, &server->name_limit, 1, now );
+}
+
+/*
+ * Forgets buckets that are full again and sources we are not reading from,
+ * they would start out the same when they come back
+ *
+ * @param server holds the buckets
+ */
+static void prune_limits( struct ccn_info_server *server ){
+  gint64 now = g_get_monotonic_time();
+  GHashTableIter iter;
+  gpointer value;
+
+  if ( now < server->next_prune )
+    return;
+  server->next_prune = now + G_USEC_PER_SEC;
+
+  g_hash_table_iter_init( &iter, server->names );
+  while ( g_hash_table_iter_next( &iter, NULL, &value ) ){
+    bucket_refill( value, &server->name_limit, now );
+    if ( ((struct token_bucket*)value)->tokens >= server->name_limit.burst )
+      g_hash_table_iter_remove( &iter );
+  }
+
+  g_hash_table_iter_init( &iter, server->clients );
+  while ( g_hash_table_iter_next( &iter, NULL, &value ) ){
+    struct tcp_client *client = value;
+    bucket_refill( &client->bytes, &server->register_limit, now );
+    if ( client->connections == 0 && client->bytes.tokens >= server->register_limit.burst )
+      g_hash_table_iter_remove( &iter );
+  }
+}
+
 /*
  * Checks whether the interest name is valid
  * We are expecting ccnx:/name/prefix/server format
@@ -176,7 +482,8 @@ int info_interest_valid(struct ccn_charbuf *prefix,
 }
 
 /*
- * Build an info response, returning the IP address of the chosen interface
+ * Build an info response, returning the IP address of the chosen interface.
+ * The answer is named ccnx:/name/prefix/server/host:port.
  *
  * @param h     ccn handler object, required by everything related to ccn
  * @param data  same thing as handler, required by everything related to ccn
@@ -186,86 +493,149 @@ int info_interest_valid(struct ccn_charbuf *prefix,
 int construct_info_response(struct ccn *h, struct ccn_charbuf *data, 
         const unsigned char *interest_msg, const struct ccn_parsed_interest *pi, struct ccn_info_server *server)
 {
-    struct ccn_charbuf *name = ccn_charbuf_create();
-    struct ccn_signing_params sp = CCN_SIGNING_PARAMS_INIT;
-    int res;
-    char buffer[NI_MAXHOST+6];
-
-    ccn_charbuf_append(name, interest_msg + pi->offset[CCN_PI_B_Name],
-            pi->offset[CCN_PI_E_Name] - pi->offset[CCN_PI_B_Name]);
-
-    //set freshness seconds
-    if (server->expire >= 0) {
-        sp.template_ccnb = ccn_charbuf_create();
-        ccn_charbuf_append_tt(sp.template_ccnb, CCN_DTAG_SignedInfo, CCN_DTAG);
-        ccnb_tagged_putf(sp.template_ccnb, CCN_DTAG_FreshnessSeconds, "%ld", server->expire);
-        sp.sp_flags |= CCN_SP_TEMPL_FRESHNESS;
-        ccn_charbuf_append_closer(sp.template_ccnb);
-    }
+    // Named after us, so that discovery can exclude publishers it knows,
+    // and our id is "host:port" as well
+    return ccn_sign_content(h, data, server->server_name, &server->sp_server, server->id, strlen(server->id));
+}
+
+
+/*
+ * Orders holders by score, lowest first
+ */
+static gint compare_score( gconstpointer a, gconstpointer b ){
+  double sa = registry_score( *(struct reg_node * const *)a );
+  double sb = registry_score( *(struct reg_node * const *)b );
+  return sa < sb ? -1 : sa > sb;
+}
+
+/*
+ * Next number of a splitmix64 sequence
+ */
+static guint64 next_random( guint64 *state ){
+  guint64 z = (*state += 0x9e3779b97f4a7c15ull);
 
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/*
+ * Ranks the live holders of a name so that clients, which take the first
+ * one, spread over the least loaded nodes. The same holders with the same
+ * figures always rank the same, so the answer only changes when they do.
+ *
+ * @param server  holds the ranking options
+ * @param entry   the name
+ *
+ * @return array of struct reg_node, free it with g_ptr_array_free
+ */
+GPtrArray *rank_holders( struct ccn_info_server *server, struct reg_name *entry ){
+  GPtrArray *ranked = g_ptr_array_new();
+  guint i;
+
+  for ( i = 0; entry != NULL && i < entry->holders->len; ++i ){
+    struct reg_node *node = g_ptr_array_index( entry->holders, i );
+    if ( !node->expired )
+      g_ptr_array_add( ranked, node );
+  }
+
+  if ( server->two_choices ) {
     /*
-     * TODO: Make sure we are adding our IP and Port of the server here
+     * Power of two choices: the next slot goes to the better of two random
+     * remaining holders, so equally scored nodes don't all get the top spot.
+     * The choices are drawn from the name, names spread differently.
      */
-    sprintf( buffer, "%s:%d", server->host, server->port );
-    res = ccn_sign_content(h, data, name, &sp, buffer, strlen(buffer));
+    guint64 state = entry != NULL ? entry->hash : 0;
+
+    for ( i = 0; i + 1 < ranked->len; ++i ){
+      guint a = i + next_random( &state ) % (ranked->len - i);
+      guint b = i + next_random( &state ) % (ranked->len - i);
+      guint pick = registry_score( ranked->pdata[a] ) <= registry_score( ranked->pdata[b] ) ? a : b;
+      gpointer tmp = ranked->pdata[i];
+      ranked->pdata[i] = ranked->pdata[pick];
+      ranked->pdata[pick] = tmp;
+    }
+  } else {
+    g_ptr_array_sort( ranked, compare_score );
+  }
 
-    ccn_charbuf_destroy(&sp.template_ccnb);
-    ccn_charbuf_destroy(&name);
-    return res;
+  if ( server->top_k > 0 && ranked->len > server->top_k )
+    g_ptr_array_set_size( ranked, server->top_k );
+
+  return ranked;
 }
 
+/*
+ * Tells whether a pre-signed answer still says what we would answer now:
+ * nobody came or went, no holder's lease ran out and no holder reported
+ * new load figures since we ranked them. A single holder ranks the same
+ * whatever it reports.
+ *
+ * @param pre    the answer, or NULL
+ * @param entry  the name, or NULL
+ */
+static bool prewarmed_current( const struct prewarmed *pre, const struct reg_name *entry ){
+  guint i;
+
+  if ( pre == NULL || entry == NULL || pre->version != entry->version )
+    return false;
+
+  for ( i = 0; i < entry->holders->len; ++i ){
+    const struct reg_node *node = g_ptr_array_index( entry->holders, i );
+    if ( node->load_epoch > pre->epoch && (node->expired || entry->holders->len > 1) )
+      return false;
+  }
+  return true;
+}
 
 /*
  * Build a where response, returning the location of a resource on the
- * network based on the information that clients passed to us
+ * network based on the information that clients passed to us. The answer
+ * is named after the Interest plus a version that moves whenever the
+ * answer does, so that caches can keep it until then.
  *
- * @param h     ccn handler object, required by everything related to ccn
- * @param data  same thing as handler, required by everything related to ccn
+ * @param h          ccn handler object, required by everything related to ccn
+ * @param data       gets the signed answer
+ * @param interest   ccnb Name the Interest asked for, ccnx:/name/prefix/where/bucket/name
+ * @param size       its length
+ * @param buffer     the name we are looking for
  *
  * @return 0 if we are successful for signing the content, else -1.
  */
-int construct_where_response(struct ccn *h, struct ccn_charbuf *data, 
-        const unsigned char *interest_msg, const struct ccn_parsed_interest *pi, struct ccn_info_server *server, const char *buffer)
+int construct_where_response(struct ccn *h, struct ccn_charbuf *data,
+        const unsigned char *interest, size_t size, struct ccn_info_server *server, const char *buffer)
 {
-    struct ccn_charbuf *name = ccn_charbuf_create();
-    struct ccn_signing_params sp = CCN_SIGNING_PARAMS_INIT;
-    int res;
-    char output[BUF_SIZE+1];
-    int pointer = 0;
-
-    memset( output, '\0', sizeof(output) );
-
-    ccn_charbuf_append(name, interest_msg + pi->offset[CCN_PI_B_Name],
-            pi->offset[CCN_PI_E_Name] - pi->offset[CCN_PI_B_Name]);
-
-    //set freshness seconds
-    if (server->expire >= 0) {
-        sp.template_ccnb = ccn_charbuf_create();
-        ccn_charbuf_append_tt(sp.template_ccnb, CCN_DTAG_SignedInfo, CCN_DTAG);
-        ccnb_tagged_putf(sp.template_ccnb, CCN_DTAG_FreshnessSeconds, "%ld", server->expire);
-        sp.sp_flags |= CCN_SP_TEMPL_FRESHNESS;
-        ccn_charbuf_append_closer(sp.template_ccnb);
-    }
+    struct ccn_charbuf *name = server->answer_name;
+    GString *output = server->answer_payload;
+    struct reg_name *entry = registry_lookup( server->registry, buffer );
+    guint64 version;
 
-    printf("Building out message: %s\n %s\n", buffer, output);
-
-    GTuples *t = g_relation_select( server->relations, buffer, 0 );
+    // Best holders first
+    GPtrArray *ranked = rank_holders( server, entry );
     int i;
-    for ( i = 0; i < t->len; ++i ){
-      const char *ip = g_tuples_index( t, i, 1 );
-      strncpy( output + pointer, ip, strlen( ip ) );
-      pointer += (strlen(ip)+1);
-      output[pointer+1]='\n';
+    g_string_truncate( output, 0 );
+    for ( i = 0; i < ranked->len; ++i ){
+      struct reg_node *node = g_ptr_array_index( ranked, i );
+      g_string_append( output, node->addr );
+      g_string_append_c( output, '\n' );
     }
+    g_ptr_array_free( ranked, TRUE );
 
-    printf("Building out message: %s\n %s\n", buffer, output);
+    /*
+     * Names nobody holds get the newest version there is, so they beat
+     * whatever older answer a cache still has, but only the short freshness.
+     */
+    if ( entry != NULL )
+      version = registry_answered( entry, scan_hash( output->str, output->len ) );
+    else
+      version = g_get_real_time();
 
-    // Now we need to extract the data from our relation database
-    res = ccn_sign_content(h, data, name, &sp, output, strlen(output));
+    ccn_charbuf_reset(name);
+    ccn_charbuf_append(name, interest, size);
+    ccn_name_append_numeric(name, CCN_MARKER_VERSION, version);
 
-    ccn_charbuf_destroy(&sp.template_ccnb);
-    ccn_charbuf_destroy(&name);
-    return res;
+    return ccn_sign_content(h, data, name, entry != NULL ? &server->sp_held : &server->sp_unheld,
+        output->str, output->len);
 }
 
 /*
@@ -293,13 +663,23 @@ enum ccn_upcall_res server_interest(struct ccn_closure *selfp,
        * is or where the server is at.
        */
       if (info_interest_valid(server->prefix_server, info->interest_ccnb, info->pi)) {
-        //construct Data content with given Interest name
-        struct ccn_charbuf *data = ccn_charbuf_create();
-        construct_info_response(info->h, data, info->interest_ccnb, info->pi, server);
+        gint64 now = g_get_monotonic_time();
+
+        /*
+         * The answer never changes, sign it once per freshness period so
+         * a crowd of clients starting at once costs us no signatures
+         */
+        if (server->info_answer == NULL || now >= server->info_expires) {
+          ccn_charbuf_destroy(&server->info_answer);
+          server->info_answer = ccn_charbuf_create();
+          construct_info_response(info->h, server->info_answer, info->interest_ccnb, info->pi, server);
+          server->info_expires = now + (gint64)MAX( server->expire, 0 ) * G_USEC_PER_SEC;
+          server->stats.server_signed ++;
+        }
 
         //send response back
-        res = ccn_put(info->h, data->buf, data->length);
-        ccn_charbuf_destroy(&data);
+        res = ccn_put(info->h, server->info_answer->buf, server->info_answer->length);
+        server->stats.server_interests ++;
 
         // TODO: Do I need this?
         server->count ++;
@@ -340,23 +720,78 @@ enum ccn_upcall_res where_interest(struct ccn_closure *selfp,
        * call is for where a specific packet 
        * is or where the server is at.
        */
+      /*
+       * We expect ccnx:/name/prefix/where/bucket/name, Interests that
+       * already name a version are left to the caches, we can only ever
+       * produce the latest one.
+       */
+      if (info->interest_comps->n - 1 != server->where_ncomps + 2)
+        break;
+
       if (info_interest_valid(server->prefix_server, info->interest_ccnb, info->pi)) {
         const unsigned char *buf;
         char *what = NULL;
         size_t length;
+        struct ccn_charbuf *data;
+        struct ccn_charbuf *key = ccn_charbuf_create();
+        struct prewarmed *pre;
+        char bucket[8];
 
-        //construct Data content with given Interest name
-        struct ccn_charbuf *data = ccn_charbuf_create();
         ccn_name_comp_get( info->interest_ccnb, info->interest_comps, info->interest_comps->n-2, &buf, &length);
+        what = g_strndup( (const char*)buf, length );
+
+        // Identical Interests in the same tick share one signed answer
+        ccn_uri_append(key, info->interest_ccnb + info->pi->offset[CCN_PI_B_Name],
+            info->pi->offset[CCN_PI_E_Name] - info->pi->offset[CCN_PI_B_Name], 0);
+        data = g_hash_table_lookup( server->inflight, ccn_charbuf_as_string(key) );
+
+        if ( data != NULL ) {
+          server->stats.where_coalesced ++;
+        } else {
+          // Somebody hashed it differently, don't answer for another shard
+          ccn_name_comp_get( info->interest_ccnb, info->interest_comps, server->where_ncomps, &buf, &length);
+          snprintf( bucket, sizeof(bucket), "%.*s", (int)MIN( length, sizeof(bucket) - 1 ), buf );
+          if ( strtoul( bucket, NULL, 16 ) != ring_bucket( what ) ) {
+            ccn_charbuf_destroy(&key);
+            g_free( what );
+            break;
+          }
+
+          // A hot name may have its answer signed already
+          struct reg_name *entry = registry_lookup( server->registry, what );
+          pre = g_hash_table_lookup( server->prewarmed, what );
+          if ( prewarmed_current( pre, entry ) ) {
+            data = pre->data;
+            server->stats.where_prewarmed ++;
+          }
+        }
+
+        if ( !admit_interest( server, data != NULL ? NULL : ccn_charbuf_as_string(key) ) ) {
+          // Cheapest way to say no, ccnd times the Interest out
+          server->stats.where_dropped ++;
+          ccn_charbuf_destroy(&key);
+          g_free( what );
+          break;
+        }
+
+        // Only names we answer count towards being hot
+        hot_add( &server->hot, what );
 
-        what = strdup( (const char*)buf );
+        if ( data == NULL ) {
+          //construct Data content with given Interest name
+          data = ccn_charbuf_create();
+          construct_where_response(info->h, data, info->interest_ccnb + info->pi->offset[CCN_PI_B_Name],
+              info->pi->offset[CCN_PI_E_Name] - info->pi->offset[CCN_PI_B_Name], server, what);
+          g_hash_table_insert( server->inflight, g_strdup(ccn_charbuf_as_string(key)), data );
 
-        construct_where_response(info->h, data, info->interest_ccnb, info->pi, server, what);
+          server->stats.where_signed ++;
+        }
+        ccn_charbuf_destroy(&key);
+        g_free( what );
 
         //send response back
         res = ccn_put(info->h, data->buf, data->length);
-        ccn_charbuf_destroy(&data);
-        free( what );
+        server->stats.where_interests ++;
 
         // TODO: Do I need this?
         server->count ++;
@@ -392,19 +827,150 @@ void create_ccn_server( struct ccn_info_server *server ){
         exit(1);
     }
 
+    // Replicas aren't members of the ring, they answer /server only to stand in, see stand_in()
     server->closure_server.data = server;
-    res = ccn_set_interest_filter(server->ccn, server->prefix_server, &server->closure_server);
+    res = server->is_replica ? 0 : ccn_set_interest_filter(server->ccn, server->prefix_server, &server->closure_server);
     if (res < 0) {
         fprintf(stderr, "Failed to register interest (res == %d)\n", res);
         exit(1);
     }
 
+    // /where filters follow the buckets we own, see update_buckets()
     server->closure_where.data = server;
-    res = ccn_set_interest_filter(server->ccn, server->prefix_where, &server->closure_where);
-    if (res < 0) {
-        fprintf(stderr, "Failed to register interest (res == %d)\n", res);
-        exit(1);
+}
+
+/*
+ * Signing parameters whose SignedInfo template carries the freshness and
+ * the key locator, so ccn_sign_content() copies both instead of building
+ * them for every answer
+ *
+ * @param sp          gets the parameters
+ * @param expire      FreshnessSeconds, negative for none
+ * @param keylocator  our KeyLocator, NULL to leave it to ccn_sign_content()
+ */
+static void create_signing_params( struct ccn_signing_params *sp, int expire,
+    const struct ccn_charbuf *keylocator ){
+  struct ccn_signing_params init = CCN_SIGNING_PARAMS_INIT;
+
+  *sp = init;
+  if ( expire < 0 && keylocator == NULL )
+    return;
+
+  sp->template_ccnb = ccn_charbuf_create();
+  ccn_charbuf_append_tt(sp->template_ccnb, CCN_DTAG_SignedInfo, CCN_DTAG);
+  if ( expire >= 0 ) {
+    ccnb_tagged_putf(sp->template_ccnb, CCN_DTAG_FreshnessSeconds, "%d", expire);
+    sp->sp_flags |= CCN_SP_TEMPL_FRESHNESS;
+  }
+  if ( keylocator != NULL ) {
+    ccn_charbuf_append_charbuf(sp->template_ccnb, keylocator);
+    sp->sp_flags |= CCN_SP_TEMPL_KEY_LOCATOR;
+  }
+  ccn_charbuf_append_closer(sp->template_ccnb);
+}
+
+/*
+ * Builds what every answer of a kind shares once, so answering is down to
+ * the name, the payload and the signature. Signing and ccn_put() need the
+ * whole ContentObject in one buffer, there is nothing to gather.
+ *
+ * @param server the server, connected to ccnd
+ */
+void create_templates( struct ccn_info_server *server ){
+  struct ccn_charbuf *digest = ccn_charbuf_create();
+  struct ccn_charbuf *key = ccn_charbuf_create();
+  struct ccn_charbuf *keylocator = NULL;
+
+  // The key ccn_sign_content() signs with, the one ccnd knows us by
+  if ( ccn_get_public_key( server->ccn, NULL, digest, key ) >= 0 ) {
+    keylocator = ccn_charbuf_create();
+    ccn_charbuf_append_tt(keylocator, CCN_DTAG_KeyLocator, CCN_DTAG);
+    ccnb_append_tagged_blob(keylocator, CCN_DTAG_Key, key->buf, key->length);
+    ccn_charbuf_append_closer(keylocator);
+  } else {
+    fprintf(stderr, "Could not get our public key, answers build their key locator\n");
+  }
+
+  create_signing_params( &server->sp_server, server->expire, keylocator );
+  create_signing_params( &server->sp_held, server->expire_versioned, keylocator );
+  create_signing_params( &server->sp_unheld, server->expire, keylocator );
+
+  server->server_name = ccn_charbuf_create();
+  ccn_charbuf_append_charbuf(server->server_name, server->prefix_server);
+  ccn_name_append_str(server->server_name, server->id);
+
+  server->answer_name    = ccn_charbuf_create();
+  server->answer_payload = g_string_sized_new( 1024 );
+
+  ccn_charbuf_destroy(&keylocator);
+  ccn_charbuf_destroy(&key);
+  ccn_charbuf_destroy(&digest);
+}
+
+/*
+ * Registers /where/bucket filters for the buckets the ring gives us and
+ * drops the ones that moved to another publisher
+ *
+ * @param server the server holding the ring
+ */
+void update_buckets( struct ccn_info_server *server ){
+  struct ccn_charbuf *name = ccn_charbuf_create();
+  guint bucket, count = 0;
+
+  for ( bucket = 0; bucket < RING_BUCKETS; ++bucket ){
+    const char *owner = ring_owner( server->discovery.ring, bucket );
+    bool mine = owner != NULL && strcmp( owner, server->id ) == 0;
+    char component[8];
+
+    count += mine;
+    if ( mine == server->owned[bucket] )
+      continue;
+
+    snprintf( component, sizeof(component), RING_BUCKET_FORMAT, bucket );
+    ccn_charbuf_reset( name );
+    ccn_charbuf_append_charbuf( name, server->prefix_where );
+    ccn_name_append_str( name, component );
+
+    if ( ccn_set_interest_filter( server->ccn, name, mine ? &server->closure_where : NULL ) < 0 ) {
+      fprintf(stderr, "Failed to register interest for bucket %s\n", component);
+      continue;
     }
+    server->owned[bucket] = mine;
+  }
+
+  fprintf( stderr, "Buckets : %u of %d\n", count, RING_BUCKETS );
+  ccn_charbuf_destroy(&name);
+}
+
+/*
+ * The set of publishers changed, take over or hand off buckets
+ */
+static void ring_changed( struct ring_discovery *disc, void *data ){
+  update_buckets( data );
+}
+
+/*
+ * Stands in for the primary of a replica while it is silent. We answer
+ * /server under its id, so nobody drops it from the ring and its buckets
+ * stay with us, and hand /server back once we hear from it again.
+ *
+ * @param server the replica
+ */
+static void stand_in( struct ccn_info_server *server ){
+  bool silent = repl_replica_silent( &server->replica, g_get_monotonic_time() );
+
+  if ( silent == server->standing_in )
+    return;
+
+  if ( ccn_set_interest_filter( server->ccn, server->prefix_server, silent ? &server->closure_server : NULL ) < 0 ) {
+    fprintf(stderr, "Failed to register interest for /server\n");
+    return;
+  }
+
+  server->standing_in = silent;
+  server->stats.takeovers += silent;
+  discovery_set_self( &server->discovery, silent ? server->id : NULL );
+  fprintf( stderr, "Replica : %s %s\n", silent ? "standing in for" : "handing back to", server->id );
 }
 
 /*
@@ -426,75 +992,539 @@ void create_tcp_server( struct ccn_info_server *server ){
   /* bind serv information to mysocket */
   bind(server->socket, (struct sockaddr *)&(server->serv), sizeof(struct sockaddr));
 
+  listen(server->socket, 16);
+  g_queue_init( &server->reading );
+  g_queue_init( &server->ready );
 }
 
 /*
- * Parses a tcp packet received from one of the clients, the procedure involves
- * extracting the meta data about the remove repository 
- *
- * @param server The server that has the port and the socket structure
+ * Closes a connection and lets go of its client and its buffer
  *
+ * @param server  counts the buffered bytes
+ * @param conn    the connection
  */
-void parse_tcp_packet( struct ccn_info_server *server, char *buffer, struct sockaddr_in *dest ){
-
-  char addr[NI_MAXHOST];
+void tcp_close( struct ccn_info_server *server, struct tcp_conn *conn ){
+  server->buffered -= conn->length;
+  if ( conn->client != NULL )
+    conn->client->connections --;
+  if ( conn->fd >= 0 )
+    close(conn->fd);
+  if ( conn->previous != NULL )
+    g_string_free(conn->previous, TRUE);
+  g_free(conn->buffer);
+  g_free(conn);
+}
 
-  getnameinfo((const struct sockaddr*)dest,
-      sizeof(struct sockaddr_in),
-      addr, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
+/*
+ * Answers a node, "OK <lease>" or "RESYNC" if it has to send all its names,
+ * and forgets about the connection
+ *
+ * @param server  holds the lease
+ * @param conn    the connection
+ * @param res     0 if we are fine, -1 to ask for a resync
+ */
+void tcp_finish( struct ccn_info_server *server, struct tcp_conn *conn, int res ){
+  char reply[32];
 
-  char *buf = strdup( buffer );
-  char *pch = strtok( buf, "\n" );
+  if ( res == 0 )
+    snprintf( reply, sizeof(reply), "OK %d\n", server->lease );
+  else
+    snprintf( reply, sizeof(reply), "RESYNC\n" );
 
-  // Remove all the ip instances in our mini database
-  g_relation_delete( server->relations, addr, 1 );
+  send(conn->fd, reply, strlen(reply), MSG_NOSIGNAL);
+  tcp_close(server, conn);
+}
 
-  while ( pch != NULL ){
-    // Add the Data->Ip relationship
-    g_relation_insert( server->relations, strdup(pch), strdup(addr) );
+/*
+ * Parses the next part of a registration received from one of the clients,
+ * the procedure involves extracting the meta data about the remote
+ * repository. Lines starting with '!' are directives, a payload that starts
+ * with "!heartbeat" only renews the lease of the node. After a "!fc" line
+ * names are front coded, "<shared>\t<suffix>".
+ *
+ * @param server  The server that has the registry
+ * @param conn    A complete registration
+ * @param chunk   About how many bytes we may ingest
+ *
+ * @return true once the whole registration is in
+ */
+bool parse_tcp_packet( struct ccn_info_server *server, struct tcp_conn *conn, size_t chunk ){
+  GArray *lines = g_array_new( FALSE, FALSE, sizeof(struct scan_line) );
+  GArray *offsets = NULL;
+  GString *plain = NULL;
+  size_t end = conn->offset + chunk;
+  guint i, count = 0;
+
+  // Cut right after a newline, the next part starts with a whole line
+  if ( conn->heartbeat || end >= conn->length ) {
+    end = conn->length;
+  } else {
+    char *nl = memchr( conn->buffer + end, '\n', conn->length - end );
+    end = nl != NULL ? nl - conn->buffer + 1 : conn->length;
+  }
 
-    fprintf( stderr, "Got : %s\n", pch );
-    pch = strtok( NULL, "\n" );
+  scan_lines( conn->buffer + conn->offset, end - conn->offset, lines );
+  conn->offset = end;
+
+  // Pull out the directives, names get packed at the front
+  for ( i = 0; i < lines->len; ++i ){
+    struct scan_line *line = &g_array_index( lines, struct scan_line, i );
+
+    if ( line->name[0] == '!' ) {
+      if ( strcmp( line->name, FC_DIRECTIVE ) == 0 && conn->previous == NULL )
+        conn->previous = g_string_new( NULL );
+      else if ( sscanf( line->name, "!load %lf %lf", &conn->load, &conn->cpus ) == 2 )
+        conn->reported = true;
+    } else if ( conn->previous != NULL ) {
+      // Rebuild the name from the one before, plain gets them all
+      if ( !fc_decode_line( conn->previous, line->name ) )
+        continue;
+      if ( plain == NULL ) {
+        plain = g_string_new( NULL );
+        offsets = g_array_new( FALSE, FALSE, sizeof(gsize) );
+      }
+      while ( offsets->len < count ) {
+        gsize none = G_MAXSIZE;
+        g_array_append_val( offsets, none );
+      }
+      g_array_append_val( offsets, plain->len );
+      g_string_append_len( plain, conn->previous->str, conn->previous->len + 1 );
+
+      line->length = conn->previous->len;
+      line->hash   = scan_hash( conn->previous->str, conn->previous->len );
+      g_array_index( lines, struct scan_line, count++ ) = *line;
+    } else {
+      g_array_index( lines, struct scan_line, count++ ) = *line;
+    }
   }
 
+  // plain is done growing, point the decoded lines into it
+  for ( i = 0; offsets != NULL && i < offsets->len; ++i ){
+    gsize offset = g_array_index( offsets, gsize, i );
+    if ( offset != G_MAXSIZE )
+      g_array_index( lines, struct scan_line, i ).name = plain->str + offset;
+  }
 
+  if ( !conn->heartbeat ) {
+    if ( conn->sync == NULL )
+      conn->sync = registry_sync_begin( server->registry, conn->addr, conn->length );
+    registry_sync_feed( conn->sync, (struct scan_line*)lines->data, count );
+  }
+  g_array_free( lines, TRUE );
+  if ( plain != NULL ) {
+    g_string_free( plain, TRUE );
+    g_array_free( offsets, TRUE );
+  }
 
-  free(buf);
+  return conn->offset == conn->length;
 }
 
 /*
- * Check for any pending connections, open them up, recv stuff
- * parse those stuff and be DONE.
- * 
+ * Accepts every pending connection, without blocking
+ *
  * @param server contains our server socket instance
  */
-void tcp_run( struct ccn_info_server *server ){
+void tcp_accept( struct ccn_info_server *server ){
   socklen_t socksize = sizeof(struct sockaddr_in);
   struct sockaddr_in dest; /* socket info about the machine connecting to us */
+  int consocket;
+
+  while ( (consocket = accept(server->socket, (struct sockaddr *)&dest, &socksize)) != -1 ) {
+    char addr[NI_MAXHOST];
+    struct tcp_client *client;
+    struct tcp_conn *conn;
+
+    socksize = sizeof(struct sockaddr_in);
+    getnameinfo((const struct sockaddr*)&dest,
+        sizeof(struct sockaddr_in),
+        addr, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
+
+    client = g_hash_table_lookup( server->clients, addr );
+    if ( client == NULL ) {
+      client = g_new0( struct tcp_client, 1 );
+      g_strlcpy( client->addr, addr, NI_MAXHOST );
+      client->bytes = bucket_full( &server->register_limit, g_get_monotonic_time() );
+      g_hash_table_insert( server->clients, client->addr, client );
+    }
+
+    // A node needs one connection at a time, a few more is plenty. Replicas count too.
+    if ( client->connections + repl_primary_peers( &server->replication, addr ) >= MAX_CONNECTIONS ) {
+      client->refused ++;
+      close(consocket);
+      continue;
+    }
+
+    conn = g_new0( struct tcp_conn, 1 );
+    fcntl(consocket, F_SETFL, O_NONBLOCK);
+    conn->fd = consocket;
+    conn->capacity = BUF_SIZE;
+    conn->buffer = g_malloc( conn->capacity + 1 );
+    conn->active = g_get_monotonic_time();
+    g_strlcpy( conn->addr, addr, NI_MAXHOST );
+
+    conn->client = client;
+    client->connections ++;
+
+    g_queue_push_tail( &server->reading, conn );
+  }
+}
+
+/*
+ * @return how many bytes all connections may buffer together: what is
+ *         left of the registry budget, MAX_BUFFERED without one
+ */
+static gsize buffer_limit( struct ccn_info_server *server ){
+  struct registry *reg = server->registry;
+
+  if ( reg->budget == 0 )
+    return MAX_BUFFERED;
+  return reg->budget > reg->bytes ? reg->budget - reg->bytes : 0;
+}
+
+/*
+ * @return how many bytes one connection may buffer: all the room the
+ *         registry can make for its node by evicting others, MAX_BUFFERED
+ *         without a budget
+ */
+static gsize conn_limit( struct ccn_info_server *server, struct tcp_conn *conn ){
+  struct tcp_conn *ingesting = g_queue_peek_head( &server->ready );
+
+  if ( server->registry->budget == 0 )
+    return MAX_BUFFERED;
+  return MAX( registry_room( server->registry, ingesting != NULL ? ingesting->sync : NULL, conn->addr ), BUF_SIZE );
+}
+
+/*
+ * Reads whatever the nodes sent us, at most READ_BUDGET bytes each per
+ * tick and no more than the tokens their source has left. What we don't
+ * read stays in the socket, the sender blocks once its window is full.
+ * Complete registrations move on to the ready queue.
+ *
+ * Buffers count against the registry budget: once they hold all that is
+ * left of it only the oldest connection is read. A connection that alone
+ * sends more than the registry could make room for, evicting every node
+ * but the one we are ingesting, is closed. So is one that sends nothing
+ * for CONN_IDLE seconds.
+ *
+ * @param server contains the connections
+ */
+void tcp_read( struct ccn_info_server *server ){
+  GList *link = g_queue_peek_head_link( &server->reading );
+  gint64 now = g_get_monotonic_time();
+  gsize limit = buffer_limit( server );
+
+  while ( link != NULL ) {
+    GList *next = link->next;
+    struct tcp_conn *conn = link->data;
+    struct tcp_client *client = conn->client;
+    size_t budget = READ_BUDGET;
+    gsize cap = conn_limit( server, conn );
+    ssize_t size = -1;
+
+    errno = EAGAIN;
+    if ( server->register_limit.rate > 0 ) {
+      bucket_refill( &client->bytes, &server->register_limit, now );
+      budget = MIN( budget, (size_t)MAX( client->bytes.tokens, 0 ) );
+      if ( budget == 0 )
+        client->throttled ++;
+    }
+    if ( server->buffered >= limit && link != g_queue_peek_head_link( &server->reading ) )
+      budget = 0;
+
+    // Held back by us, not stalled
+    if ( budget == 0 )
+      conn->active = now;
+
+    while ( budget > 0 &&
+        (size = recv( conn->fd, conn->buffer + conn->length, MIN( budget, conn->capacity - conn->length ), 0 )) > 0 ) {
+      conn->length += size;
+      server->buffered += size;
+      conn->active = now;
+      budget -= size;
+      client->read += size;
+      if ( server->register_limit.rate > 0 )
+        client->bytes.tokens -= size;
+      if ( conn->length > cap )
+        break;
+      if ( conn->length == conn->capacity ) {
+        conn->capacity *= 2;
+        conn->buffer = g_realloc( conn->buffer, conn->capacity + 1 );
+      }
+    }
+
+    if ( conn->length > cap ) {
+      fprintf( stderr, "Oversized : %s sent more than %zu bytes\n", conn->addr, cap );
+      server->stats.conn_oversized ++;
+      tcp_close( server, conn );
+      g_queue_delete_link( &server->reading, link );
+      link = next;
+      continue;
+    }
+    if ( size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        now - conn->active > (gint64)CONN_IDLE * G_USEC_PER_SEC ) {
+      server->stats.conn_timeouts ++;
+      tcp_close( server, conn );
+      g_queue_delete_link( &server->reading, link );
+      link = next;
+      continue;
+    }
+
+    if ( conn->length > strlen(REPL_DIRECTIVE) && memchr( conn->buffer, '\n', conn->length ) != NULL &&
+        strncmp( conn->buffer, REPL_DIRECTIVE, strlen(REPL_DIRECTIVE) ) == 0 ) {
+      // A replica we allowed, it stays connected and gets our changes from now on
+      conn->buffer[conn->length] = '\0';
+      if ( repl_primary_subscribe( &server->replication, conn->fd, conn->addr, conn->buffer ) )
+        conn->fd = -1;
+      tcp_close( server, conn );
+      g_queue_delete_link( &server->reading, link );
+    } else if ( size == 0 ) {
+      // The node is done sending
+      conn->buffer[conn->length] = '\0';
+      conn->heartbeat = strncmp( conn->buffer, "!heartbeat", 10 ) == 0;
+      g_queue_delete_link( &server->reading, link );
+      g_queue_push_tail( &server->ready, conn );
+    } else if ( size < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+      tcp_close( server, conn );
+      g_queue_delete_link( &server->reading, link );
+    }
+
+    link = next;
+  }
+}
+
+/*
+ * @return true if ccnd has something for us, Interests are waiting
+ */
+bool ccn_pending( struct ccn_info_server *server ){
+  struct pollfd fd = { .fd = ccn_get_connection_fd( server->ccn ), .events = POLLIN };
+  return poll( &fd, 1, 0 ) > 0;
+}
+
+/*
+ * Ingests complete registrations, oldest first, until the slice of the
+ * tick ends. Parts are sized from the rate we ingested at so far, and we
+ * stop as soon as ccnd has Interests for us.
+ *
+ * @param server    contains the ready queue and the scheduler state
+ * @param deadline  monotonic time the slice ends
+ */
+void ingest( struct ccn_info_server *server, gint64 deadline ){
+
+  while ( !g_queue_is_empty( &server->ready ) && !ccn_pending( server ) ){
+    struct tcp_conn *conn = g_queue_peek_head( &server->ready );
+    gint64 start = g_get_monotonic_time();
+    size_t before = conn->offset;
+    size_t chunk;
 
-  /* start listening, allowing a queue of up to 1 pending connection */
-  listen(server->socket, 1);
-  int consocket = accept(server->socket, (struct sockaddr *)&dest, &socksize);
+    if ( start >= deadline )
+      break;
+    chunk = CLAMP( (deadline - start) * server->ingest_rate, MIN_CHUNK, MAX_CHUNK );
 
-  if ( consocket != -1 ) {
-    char buffer[64*1024+1];
-    char *ptr = buffer;
+    bool done = parse_tcp_packet( server, conn, chunk );
 
-    // Make sure we are listening doing a 
-    fcntl(consocket, F_SETFL, !O_NONBLOCK);
+    // bytes per usec, smoothed
+    gint64 took = g_get_monotonic_time() - start;
+    server->ingest_rate = 0.8 * server->ingest_rate + 0.2 * (conn->offset - before) / (took + 1);
+
+    if ( !done )
+      continue;
 
-    // Read the sent message, and parse it
-    int size = 0;
-    
-    while( (size = recv( consocket, (void*)ptr, 64*1024, 0 ) ) != 0 ) {
-      ptr += size;
+    g_queue_pop_head( &server->ready );
+
+    int res = 0;
+    if ( conn->heartbeat ) {
+      if ( !registry_renew( server->registry, conn->addr ) )
+        res = -1;
+      else
+        repl_log_renew( &server->replication, conn->addr );
+    } else {
+      registry_sync_commit( conn->sync );
+      repl_log_sync( &server->replication, conn->addr );
+      fprintf( stderr, "Got : %zu bytes from %s\n", conn->length, conn->addr );
     }
+    if ( conn->reported && res == 0 ) {
+      registry_report( server->registry, conn->addr, conn->load, conn->cpus );
+      repl_log_load( &server->replication, conn->addr, conn->load, conn->cpus );
+    }
+
+    tcp_finish( server, conn, res );
+  }
+}
+
+/*
+ * Adjusts the ingestion slice to how long ccnd had to wait for us since
+ * we last served it, halving it when we missed the target and growing it
+ * back slowly when we didn't
+ *
+ * @param server holds the scheduler state
+ */
+void adapt_slice( struct ccn_info_server *server ){
+  gint64 latency = g_get_monotonic_time() - server->served_at;
+
+  server->stats.worst_latency = MAX( server->stats.worst_latency, latency );
+
+  if ( latency > server->latency_target )
+    server->slice = MAX( server->slice / 2, MIN_SLICE );
+  else
+    server->slice = MIN( server->slice + server->latency_target / 10, server->latency_target );
+}
+
+/*
+ * Frees a pre-signed answer, the value destroy function of prewarmed
+ */
+static void free_prewarmed( gpointer data ){
+  struct prewarmed *pre = data;
+  ccn_charbuf_destroy( &pre->data );
+  g_free( pre );
+}
 
-    // Parse
-    parse_tcp_packet( server, buffer, &dest );
+/*
+ * Signs the answers of the hottest names whose holders changed since we
+ * last signed them, so the next Interest for them doesn't wait on it.
+ * At most PREWARM_BUDGET signatures a tick, hottest first, none while
+ * Interests are waiting. We forget the answers of names that cooled down.
+ *
+ * @param server holds the tracker and the answers
+ */
+void prewarm( struct ccn_info_server *server ){
+  GHashTableIter iter;
+  gpointer name;
+  GPtrArray *hot;
+  guint i, signed_now = 0;
+
+  hot_decay( &server->hot, g_get_monotonic_time() );
+
+  g_hash_table_iter_init( &iter, server->prewarmed );
+  while ( g_hash_table_iter_next( &iter, &name, NULL ) )
+    if ( !hot_contains( &server->hot, name ) )
+      g_hash_table_iter_remove( &iter );
+
+  hot = hot_sorted( &server->hot );
+  for ( i = 0; i < hot->len && signed_now < PREWARM_BUDGET; ++i ){
+    struct hot_item *item = g_ptr_array_index( hot, i );
+    struct reg_name *entry = registry_lookup( server->registry, item->name );
+    struct prewarmed *pre = g_hash_table_lookup( server->prewarmed, item->name );
+    guint bucket = ring_bucket( item->name );
+    char component[8];
+
+    // Nobody holds it, or somebody else answers for it
+    if ( entry == NULL || !server->owned[bucket] ) {
+      g_hash_table_remove( server->prewarmed, item->name );
+      continue;
+    }
+    if ( prewarmed_current( pre, entry ) )
+      continue;
+    if ( ccn_pending( server ) )
+      break;
 
-    send(consocket, "OK", 3, 0); 
-    close(consocket);
+    // The name an Interest for it has, see processWhere in troute
+    struct ccn_charbuf *interest = ccn_charbuf_create();
+    snprintf( component, sizeof(component), RING_BUCKET_FORMAT, bucket );
+    ccn_charbuf_append_charbuf( interest, server->prefix_where );
+    ccn_name_append_str( interest, component );
+    ccn_name_append_str( interest, item->name );
+
+    // The version is settled as the answer is built
+    pre = g_new( struct prewarmed, 1 );
+    pre->epoch   = server->registry->load_epoch;
+    pre->data    = ccn_charbuf_create();
+    if ( construct_where_response( server->ccn, pre->data, interest->buf, interest->length, server, item->name ) < 0 ) {
+      free_prewarmed( pre );
+    } else {
+      pre->version = entry->version;
+      g_hash_table_insert( server->prewarmed, g_strdup( item->name ), pre );
+      server->stats.prewarm_signed ++;
+    }
+    ccn_charbuf_destroy( &interest );
+    signed_now ++;
+  }
+  g_ptr_array_free( hot, TRUE );
+}
+
+/*
+ * Remembers that someone asked for the stats, they are dumped from the loop
+ *
+ * @param signum the signal we got, always SIGUSR1
+ */
+static void request_stats( int signum ){
+  dump_stats_requested = 1;
+}
+
+/*
+ * Writes our counters to stderr
+ *
+ * @param server holds the stats
+ */
+void dump_stats( struct ccn_info_server *server ){
+  struct registry *reg = server->registry;
+
+  GHashTableIter iter;
+  gpointer value;
+
+  GPtrArray *hot;
+  guint i;
+
+  fprintf( stderr, "Stats : server %lu/%lu where %lu signed %lu coalesced %lu dropped %lu prewarmed %lu/%lu\n",
+      server->stats.server_interests,
+      server->stats.server_signed,
+      server->stats.where_interests,
+      server->stats.where_signed,
+      server->stats.where_coalesced,
+      server->stats.where_dropped,
+      server->stats.where_prewarmed,
+      server->stats.prewarm_signed );
+  fprintf( stderr, "Registry : nodes %u names %u bytes %zu/%zu stored %zu expired %lu evicted %lu dropped %lu reclaiming %u parallel %lu\n",
+      g_hash_table_size( reg->nodes ),
+      reg->name_count,
+      reg->bytes, reg->budget, reg->stored,
+      reg->expired, reg->evicted, reg->dropped,
+      reg->reclaim.length, reg->parallel );
+  fprintf( stderr, "Scheduler : slice %" G_GINT64_FORMAT " us target %" G_GINT64_FORMAT " us worst %" G_GINT64_FORMAT " us rate %.1f B/us pending %u\n",
+      server->slice, server->latency_target, server->stats.worst_latency,
+      server->ingest_rate, server->reading.length + server->ready.length );
+  server->stats.worst_latency = 0;
+
+  fprintf( stderr, "Limits : registrations %.0f B/s per source, where %.0f/s, %.0f/s per name (0 = none), %u names limited\n",
+      server->register_limit.rate, server->interest_limit.rate, server->name_limit.rate,
+      g_hash_table_size( server->names ) );
+  fprintf( stderr, "Connections : buffered %zu/%zu bytes, timed out %lu oversized %lu\n",
+      server->buffered, buffer_limit( server ),
+      server->stats.conn_timeouts, server->stats.conn_oversized );
+  g_hash_table_iter_init( &iter, server->clients );
+  while ( g_hash_table_iter_next( &iter, NULL, &value ) ){
+    struct tcp_client *client = value;
+    fprintf( stderr, "Client : %s read %" G_GUINT64_FORMAT " bytes throttled %lu connections %u refused %lu tokens %.0f\n",
+        client->addr, client->read, client->throttled, client->connections, client->refused, client->bytes.tokens );
+  }
+
+  // Estimates from the sketch, recent ones weigh more, see HOT_DECAY
+  fprintf( stderr, "Hot : %u of %" G_GUINT64_FORMAT " lookups tracked, %u answers pre-signed\n",
+      server->hot.top->len, server->hot.total, g_hash_table_size( server->prewarmed ) );
+  hot = hot_sorted( &server->hot );
+  for ( i = 0; i < hot->len; ++i ){
+    struct hot_item *item = g_ptr_array_index( hot, i );
+    fprintf( stderr, "Hot : %u %s\n", item->count, item->name );
+  }
+  g_ptr_array_free( hot, TRUE );
+
+  if ( server->is_replica ) {
+    struct repl_replica *r = &server->replica;
+    fprintf( stderr, "Replica : primary %s %s%s applied %" G_GUINT64_FORMAT " head %" G_GUINT64_FORMAT
+        " lag %" G_GINT64_FORMAT " ms records %lu snapshots %lu connects %lu takeovers %lu\n",
+        r->primary, r->connected ? "connected" : "disconnected", server->standing_in ? " standing in" : "",
+        r->applied, r->head, repl_replica_lag( r ) / 1000, r->records, r->snapshots, r->connects,
+        server->stats.takeovers );
+    return;
+  }
+
+  fprintf( stderr, "Replication : head %" G_GUINT64_FORMAT " log %u records %zu bytes snapshots %lu replicas %u of %u allowed, refused %lu\n",
+      server->replication.head, server->replication.records.length, server->replication.bytes,
+      server->replication.snapshots, server->replication.peers->len, server->replication.allowed->len,
+      server->replication.refused );
+  for ( i = 0; i < server->replication.peers->len; ++i ){
+    struct repl_peer *peer = g_ptr_array_index( server->replication.peers, i );
+    fprintf( stderr, "Replica : %s behind %" G_GUINT64_FORMAT " records, %zu bytes queued\n",
+        peer->addr, server->replication.head + 1 - peer->next, peer->out->len - peer->offset );
   }
 }
 
@@ -505,17 +1535,73 @@ void tcp_run( struct ccn_info_server *server ){
  */
 void loop( struct ccn_info_server *server ){
     create_ccn_server( server );
-    create_tcp_server( server );
+    create_templates( server );
+    if ( !server->is_replica )
+      create_tcp_server( server );
+
+    // We own everything until discovery finds somebody else, replicas own
+    // nothing until it found their primary
+    discovery_init( &server->discovery, server->ccn, server->prefix_server,
+        server->is_replica ? NULL : server->id, ring_changed, server );
+    update_buckets( server );
+
+    server->served_at = g_get_monotonic_time();
+    server->interests = bucket_full( &server->interest_limit, server->served_at );
 
     while(true){
-      ccn_run(server->ccn, 500);
-      tcp_run(server);
+      bool busy = !g_queue_is_empty( &server->ready ) || server->replica.backlog;
+      gint64 deadline;
+
+      // Interests first, we only wait on ccnd when we have nothing else to do
+      adapt_slice( server );
+      ccn_run(server->ccn, busy ? 0 : IDLE_TIMEOUT);
+      server->served_at = g_get_monotonic_time();
+      discovery_run( &server->discovery );
+
+      // The tick is over, whatever we answered is no longer in flight
+      g_hash_table_remove_all( server->inflight );
+
+      // Replicas apply the changes of their primary within the slice as well,
+      // and replicas of ours get what ingestion leaves of it
+      deadline = g_get_monotonic_time() + server->slice;
+
+      if ( server->is_replica ) {
+        repl_replica_run( &server->replica, deadline );
+        stand_in( server );
+      } else {
+        tcp_accept(server);
+        tcp_read(server);
+        ingest(server, deadline);
+        repl_primary_run( &server->replication, deadline );
+      }
+      prune_limits(server);
+
+      // Drop nodes whose lease ran out, a bounded number of names per tick.
+      // Standing in nobody can renew, we keep what the primary had.
+      if ( !server->standing_in )
+        registry_expire( server->registry, g_get_monotonic_time(), RECLAIM_BUDGET );
+
+      // Holders may have changed, get the hot answers ready again
+      prewarm(server);
+
+      if ( dump_stats_requested ) {
+        dump_stats_requested = 0;
+        dump_stats( server );
+      }
     }
 
-    close(server->socket);
+    if ( !server->is_replica )
+      close(server->socket);
 
     ccn_destroy(&(server->ccn));
+    ccn_charbuf_destroy(&server->info_answer);
     ccn_charbuf_destroy(&server->prefix_server);
+    ccn_charbuf_destroy(&server->sp_server.template_ccnb);
+    ccn_charbuf_destroy(&server->sp_held.template_ccnb);
+    ccn_charbuf_destroy(&server->sp_unheld.template_ccnb);
+    ccn_charbuf_destroy(&server->server_name);
+    ccn_charbuf_destroy(&server->answer_name);
+    g_string_free(server->answer_payload, TRUE);
 }
 
 /*
@@ -556,6 +1642,20 @@ void create_ccn_prefixes( struct ccn_info_server *server, char **argv, const cha
         fprintf(stderr, "%s: error constructing ccn URI: %s/%s\n", progname, argv[0], WHERE_SUFFIX);
         exit(1);
     }
+
+    struct ccn_indexbuf *comps = ccn_indexbuf_create();
+    server->where_ncomps = ccn_name_split(server->prefix_where, comps);
+    ccn_indexbuf_destroy(&comps);
+}
+
+/*
+ * GDestroyNotify wrapper around ccn_charbuf_destroy
+ *
+ * @param data the ccn_charbuf to free
+ */
+static void destroy_charbuf( gpointer data ){
+  struct ccn_charbuf *c = data;
+  ccn_charbuf_destroy( &c );
 }
 
 /*
@@ -564,9 +1664,24 @@ void create_ccn_prefixes( struct ccn_info_server *server, char **argv, const cha
  * @param server    our server holding information about everything and beyond
  */
 void create_hash_tables( struct ccn_info_server *server ){
-  server->relations = g_relation_new(2);
-  g_relation_index( server->relations, 0, g_str_hash, g_str_equal );
-  g_relation_index( server->relations, 1, g_str_hash, g_str_equal );
+  server->registry = registry_new( server->lease, server->budget );
+  if ( !server->is_replica )
+    repl_primary_init( &server->replication, server->registry, REPL_LOG_BYTES );
+  server->inflight = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, destroy_charbuf );
+  server->clients  = g_hash_table_new_full( g_str_hash, g_str_equal, NULL, g_free );
+  server->names    = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, g_free );
+  server->prewarmed = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, free_prewarmed );
+}
+
+/*
+ * Turns a rate into a limit that allows a second worth of burst
+ *
+ * @param limit  the limit to set
+ * @param rate   per second, 0 for no limit
+ */
+void set_limit( struct token_limit *limit, double rate ){
+  limit->rate  = rate;
+  limit->burst = rate;
 }
 
 
@@ -576,17 +1691,70 @@ void create_hash_tables( struct ccn_info_server *server ){
 int main(int argc, char **argv)
 {
     const char *progname = argv[0];
-    struct ccn_info_server server = {.count = 0, .expire = 1, .ccn = NULL};
+    struct ccn_info_server server = {.count = 0, .expire = 1, .expire_versioned = VERSIONED_EXPIRE, .lease = LEASE, .budget = 0, .top_k = 0, .two_choices = false, .ccn = NULL,
+      .latency_target = LATENCY_TARGET * 1000, .slice = LATENCY_TARGET * 1000, .ingest_rate = 1};
+
+    set_limit( &server.register_limit, REGISTER_RATE * 1024.0 );
+    set_limit( &server.interest_limit, INTEREST_RATE );
+    set_limit( &server.name_limit, NAME_RATE );
+    guint hot_top = HOT_TOP;
+    const char *primary = NULL;
+    GPtrArray *replicas = g_ptr_array_new();
+    guint i;
 
     // read the options and set the parameters
     int res;
-    while ((res = getopt(argc, argv, "hx:i:p:")) != -1) {
+    while ((res = getopt(argc, argv, "hx:X:i:p:l:m:k:rL:B:q:Q:H:R:A:")) != -1) {
         switch (res) {
             case 'x':
                 server.expire = atol(optarg);
                 if (server.expire <= 0)
                     usage(progname);
                 break;
+            case 'X':
+                server.expire_versioned = atol(optarg);
+                if (server.expire_versioned <= 0)
+                    usage(progname);
+                break;
+            case 'l':
+                server.lease = atol(optarg);
+                if (server.lease <= 0)
+                    usage(progname);
+                break;
+            case 'm':
+                server.budget = (gsize)atol(optarg) * 1024 * 1024;
+                break;
+            case 'k':
+                server.top_k = atol(optarg);
+                break;
+            case 'r':
+                server.two_choices = true;
+                break;
+            case 'L':
+                server.latency_target = atol(optarg) * 1000;
+                if (server.latency_target <= 0)
+                    usage(progname);
+                server.slice = server.latency_target;
+                break;
+            case 'B':
+                set_limit( &server.register_limit, atof(optarg) * 1024 );
+                break;
+            case 'q':
+                set_limit( &server.interest_limit, atof(optarg) );
+                break;
+            case 'Q':
+                set_limit( &server.name_limit, atof(optarg) );
+                break;
+            case 'H':
+                hot_top = atol(optarg);
+                break;
+            case 'R':
+                server.is_replica = true;
+                primary = optarg;
+                break;
+            case 'A':
+                g_ptr_array_add( replicas, optarg );
+                break;
             case 'i':
                 extract_ip( optarg, &server );
                 break;
@@ -606,13 +1774,35 @@ int main(int argc, char **argv)
     if (argv[0] == NULL)
         usage(progname);
 
+    // A replica serves the buckets of its primary, under its id
+    if ( server.is_replica )
+      g_strlcpy( server.id, primary, sizeof(server.id) );
+    else
+      snprintf( server.id, sizeof(server.id), "%s:%d", server.host, server.port );
+
     // Create the CCN prefixes and get ready to startup the server
     create_ccn_prefixes( &server, argv, progname );
     create_hash_tables( &server );
+    for ( i = 0; !server.is_replica && i < replicas->len; ++i )
+      repl_primary_allow( &server.replication, g_ptr_array_index( replicas, i ) );
+    g_ptr_array_free( replicas, TRUE );
+    if ( server.is_replica )
+      repl_replica_init( &server.replica, server.registry, primary );
+    hot_init( &server.hot, hot_top );
+    signal( SIGUSR1, request_stats );
 
     // Do the generic loop for the server
     loop( &server );
 
-    g_relation_destroy( server.relations );
+    g_hash_table_destroy( server.inflight );
+    g_hash_table_destroy( server.clients );
+    g_hash_table_destroy( server.names );
+    g_hash_table_destroy( server.prewarmed );
+    hot_clear( &server.hot );
+    if ( server.is_replica )
+      repl_replica_clear( &server.replica );
+    else
+      repl_primary_clear( &server.replication );
+    registry_destroy( server.registry );
     exit(0);
 }
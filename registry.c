@@ -0,0 +1,895 @@
+/*
+ * Registry of which node holds which name, with leases that expire on a
+ * hierarchical timer wheel and a memory budget enforced by evicting the
+ * least recently renewed nodes. Large registrations are indexed by a pool
+ * of workers, one shard each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "registry.h"
+
+#define TICK_USEC   G_USEC_PER_SEC
+
+/*
+ * Memory we charge a node for holding a name. Names are shared between
+ * holders but we charge every holder as if it had its own copy, so the
+ * budget is an upper bound and a node's charge is gone once it is gone.
+ */
+static gsize link_cost( gsize length ){
+  return length + 1 + sizeof(struct reg_name) + 2 * sizeof(gpointer);
+}
+
+/*
+ * The shard a name lives in
+ */
+static GHashTable *shard_of( struct registry *reg, guint64 hash ){
+  return reg->shards[hash >> (64 - REG_SHARD_BITS)];
+}
+
+static guint name_hash( gconstpointer key ){
+  return (guint)((const struct reg_name *)key)->hash;
+}
+
+/*
+ * The name of an entry, decoded into scratch if its home list has it
+ */
+static const char *entry_name( const struct reg_name *entry, GString *scratch ){
+  if ( entry->name != NULL )
+    return entry->name;
+
+  fc_get( entry->home->fc, entry->index, scratch );
+  return scratch->str;
+}
+
+/*
+ * Compares entries, lookups always probe with a name of their own. Safe
+ * from the sync workers, the lists are only read and compared in place.
+ */
+static gboolean name_equal( gconstpointer a, gconstpointer b ){
+  const struct reg_name *na = a, *nb = b;
+
+  if ( na->hash != nb->hash )
+    return FALSE;
+  if ( na->name != NULL && nb->name != NULL )
+    return strcmp( na->name, nb->name ) == 0;
+  if ( na->name == NULL && nb->name == NULL )
+    return na == nb;
+
+  if ( na->name == NULL )
+    return fc_equal( na->home->fc, na->index, nb->name );
+  return fc_equal( nb->home->fc, nb->index, na->name );
+}
+
+/*
+ * Frees a name entry, used as the value destroy function of the names table
+ *
+ * @param data the struct reg_name
+ */
+static void free_name( gpointer data ){
+  struct reg_name *entry = data;
+  g_ptr_array_free( entry->holders, TRUE );
+  g_free( entry->name );
+  g_free( entry );
+}
+
+/*
+ * Frees a node once all of its names were unlinked
+ *
+ * @param reg   the registry
+ * @param node  the node to free
+ */
+static void free_node( struct registry *reg, struct reg_node *node ){
+  reg->stored -= fc_bytes( node->fc );
+  fc_free( node->fc );
+  g_ptr_array_free( node->names, TRUE );
+  g_free( node );
+}
+
+/*
+ * Moves a name out of the list of a node that no longer holds it, into
+ * the list of another holder or into a copy of its own. Only called from
+ * the main loop, so the name is decoded into one scratch buffer.
+ *
+ * @param entry the name, its home list is still there
+ */
+static void rehome_name( struct reg_name *entry ){
+  static GString *scratch = NULL;
+  const char *name;
+  guint i;
+
+  if ( scratch == NULL )
+    scratch = g_string_sized_new( 256 );
+  name = entry_name( entry, scratch );
+
+  for ( i = 0; i < entry->holders->len; ++i ){
+    struct reg_node *holder = g_ptr_array_index( entry->holders, i );
+    gint index = fc_find( holder->fc, name );
+
+    if ( index >= 0 ) {
+      entry->home  = holder;
+      entry->index = index;
+      return;
+    }
+  }
+
+  // Only held by a sync that isn't committed yet
+  entry->name = g_strdup( name );
+  entry->home = NULL;
+}
+
+/*
+ * Moves the version of a name forward, called whenever its holder set
+ * changes. Versions are timestamps so they keep increasing across restarts.
+ *
+ * @param entry the name whose holders changed
+ */
+static void bump_version( struct reg_name *entry ){
+  guint64 now = g_get_real_time();
+  entry->version  = MAX( entry->version + 1, now );
+  entry->answered = 0;
+}
+
+/*
+ * Removes a node from the holders of a name, dropping the name when
+ * nobody holds it anymore
+ *
+ * @param reg    the registry
+ * @param entry  the name
+ * @param node   the node that no longer holds it
+ */
+static void unlink_name( struct registry *reg, struct reg_name *entry, struct reg_node *node ){
+  g_ptr_array_remove_fast( entry->holders, node );
+
+  if ( entry->holders->len == 0 ) {
+    g_hash_table_remove( shard_of( reg, entry->hash ), entry );
+    reg->name_count --;
+  } else {
+    if ( entry->name == NULL && entry->home == node )
+      rehome_name( entry );
+    bump_version( entry );
+  }
+}
+
+/*
+ * Puts a node on the wheel slot its lease expires in
+ *
+ * @param wheel  the timer wheel
+ * @param node   the node to schedule
+ */
+static void wheel_insert( struct timer_wheel *wheel, struct reg_node *node ){
+  guint64 expires = node->lease_expiry / TICK_USEC;
+  guint64 delta;
+  int level;
+
+  if ( expires < wheel->now )
+    expires = wheel->now;
+  delta = expires - wheel->now;
+
+  for ( level = 0; level < WHEEL_LEVELS - 1; ++level ){
+    if ( delta < ((guint64)1 << (WHEEL_BITS * (level + 1))) )
+      break;
+  }
+
+  // Longer than the wheel spans, park it in the farthest slot
+  if ( delta >= ((guint64)1 << (WHEEL_BITS * WHEEL_LEVELS)) )
+    expires = wheel->now + ((guint64)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+  node->wheel_slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  g_queue_push_tail( node->wheel_slot, node );
+  node->wheel_link = g_queue_peek_tail_link( node->wheel_slot );
+}
+
+/*
+ * Takes a node off the wheel
+ *
+ * @param node the node to unschedule
+ */
+static void wheel_remove( struct reg_node *node ){
+  if ( node->wheel_slot == NULL )
+    return;
+
+  g_queue_delete_link( node->wheel_slot, node->wheel_link );
+  node->wheel_slot = NULL;
+  node->wheel_link = NULL;
+}
+
+/*
+ * Re-inserts every node of a higher level slot, they end up in lower levels
+ *
+ * @param wheel  the timer wheel
+ * @param level  level of the slot
+ * @param index  index of the slot
+ *
+ * @return the index, cascading continues upwards when it is 0
+ */
+static int wheel_cascade( struct timer_wheel *wheel, int level, int index ){
+  GQueue *slot = &wheel->slots[level][index];
+  struct reg_node *node;
+
+  while ( (node = g_queue_pop_head( slot )) != NULL ){
+    node->wheel_slot = NULL;
+    node->wheel_link = NULL;
+    wheel_insert( wheel, node );
+  }
+
+  return index;
+}
+
+/*
+ * Takes a node out of the live tables and queues it for reclaiming
+ *
+ * @param reg   the registry
+ * @param node  the node whose lease is over
+ */
+static void expire_node( struct registry *reg, struct reg_node *node ){
+  wheel_remove( node );
+  g_queue_delete_link( &reg->lru, node->lru_link );
+  node->lru_link = NULL;
+
+  g_hash_table_steal( reg->nodes, node->addr );
+  reg->bytes -= node->bytes;
+
+  // Answers that list it are out of date from now on
+  node->expired = true;
+  node->load_epoch = ++ reg->load_epoch;
+  g_queue_push_tail( &reg->reclaim, node );
+
+  if ( reg->on_drop != NULL )
+    reg->on_drop( node, reg->on_drop_data );
+}
+
+/*
+ * Evicts the least recently renewed node to stay in the memory budget
+ *
+ * @param reg     the registry
+ * @param except  the node that is registering right now, never evicted
+ *
+ * @return true if a node was evicted
+ */
+static bool evict_one( struct registry *reg, struct reg_node *except ){
+  GList *link = g_queue_peek_head_link( &reg->lru );
+
+  if ( link != NULL && link->data == except )
+    link = link->next;
+  if ( link == NULL )
+    return false;
+
+  struct reg_node *node = link->data;
+  fprintf( stderr, "Evict : %s\n", node->addr );
+  expire_node( reg, node );
+  reg->evicted ++;
+  return true;
+}
+
+/*
+ * Pushes a node's lease forward and makes it the most recently renewed
+ *
+ * @param reg   the registry
+ * @param node  the node to renew
+ */
+static void renew_node( struct registry *reg, struct reg_node *node ){
+  node->lease_expiry = g_get_monotonic_time() + reg->lease;
+
+  wheel_remove( node );
+  wheel_insert( &reg->wheel, node );
+
+  if ( node->lru_link != NULL )
+    g_queue_delete_link( &reg->lru, node->lru_link );
+  g_queue_push_tail( &reg->lru, node );
+  node->lru_link = g_queue_peek_tail_link( &reg->lru );
+}
+
+/*
+ * A shard's part of a registration
+ *
+ * @param lines    struct scan_line pointers that fall in the shard
+ * @param first    the first line of the part
+ * @param entries  the entry of every line of the part, by position,
+ *                 lines of other shards and repeated lines stay NULL
+ * @param created  number of entries we had to create
+ */
+struct sync_job {
+  struct registry     *reg;
+  struct reg_node     *node;
+  GHashTable          *shard;
+  GPtrArray           *lines;
+  struct scan_line    *first;
+  struct reg_name    **entries;
+  guint                created;
+
+  /* counts down the jobs of a sync, the last one signals */
+  GMutex              *lock;
+  GCond               *done;
+  guint               *pending;
+};
+
+/*
+ * Indexes a shard's part of a registration. Only touches the shard and
+ * the entries in it, so shards can be filled side by side.
+ *
+ * @param job the shard's part
+ */
+static void sync_shard( struct sync_job *job ){
+  guint i, j;
+
+  for ( i = 0; i < job->lines->len; ++i ){
+    struct scan_line *line = g_ptr_array_index( job->lines, i );
+    struct reg_name probe = { .name = line->name, .hash = line->hash };
+    struct reg_name *entry = g_hash_table_lookup( job->shard, &probe );
+
+    if ( entry == NULL ) {
+      entry = g_new0( struct reg_name, 1 );
+      entry->name = g_strndup( line->name, line->length );
+      entry->hash = line->hash;
+      entry->holders = g_ptr_array_new();
+      g_hash_table_add( job->shard, entry );
+      job->created ++;
+    } else if ( entry->stamp == job->reg->stamp ) {
+      // Sent twice
+      continue;
+    }
+    entry->stamp = job->reg->stamp;
+    job->entries[line - job->first] = entry;
+
+    for ( j = 0; j < entry->holders->len; ++j )
+      if ( g_ptr_array_index( entry->holders, j ) == job->node )
+        break;
+    if ( j == entry->holders->len ) {
+      g_ptr_array_add( entry->holders, job->node );
+      bump_version( entry );
+    }
+  }
+}
+
+/*
+ * Thread pool entry point
+ */
+static void sync_worker( gpointer data, gpointer user_data ){
+  struct sync_job *job = data;
+
+  sync_shard( job );
+
+  g_mutex_lock( job->lock );
+  if ( -- *job->pending == 0 )
+    g_cond_signal( job->done );
+  g_mutex_unlock( job->lock );
+}
+
+/*
+ * Creates an empty registry
+ *
+ * @param lease   lease duration in seconds
+ * @param budget  memory budget in bytes, 0 for none
+ */
+struct registry *registry_new( int lease, gsize budget ){
+  struct registry *reg = g_new0( struct registry, 1 );
+  int level, slot;
+
+  for ( slot = 0; slot < REG_SHARDS; ++slot )
+    reg->shards[slot] = g_hash_table_new_full( name_hash, name_equal, free_name, NULL );
+  reg->nodes  = g_hash_table_new( g_str_hash, g_str_equal );
+  reg->pool   = g_thread_pool_new( sync_worker, NULL, MIN( g_get_num_processors(), REG_SHARDS ), TRUE, NULL );
+  reg->lease  = (gint64)lease * G_USEC_PER_SEC;
+  reg->budget = budget;
+
+  g_queue_init( &reg->lru );
+  g_queue_init( &reg->reclaim );
+  for ( level = 0; level < WHEEL_LEVELS; ++level )
+    for ( slot = 0; slot < WHEEL_SLOTS; ++slot )
+      g_queue_init( &reg->wheel.slots[level][slot] );
+  reg->wheel.now = g_get_monotonic_time() / TICK_USEC;
+
+  return reg;
+}
+
+/*
+ * Frees the registry and everything in it
+ *
+ * @param reg the registry
+ */
+void registry_destroy( struct registry *reg ){
+  GHashTableIter iter;
+  gpointer node;
+  int level, slot;
+
+  g_hash_table_iter_init( &iter, reg->nodes );
+  while ( g_hash_table_iter_next( &iter, NULL, &node ) )
+    free_node( reg, node );
+  while ( (node = g_queue_pop_head( &reg->reclaim )) != NULL )
+    free_node( reg, node );
+
+  for ( level = 0; level < WHEEL_LEVELS; ++level )
+    for ( slot = 0; slot < WHEEL_SLOTS; ++slot )
+      g_queue_clear( &reg->wheel.slots[level][slot] );
+  g_queue_clear( &reg->lru );
+
+  if ( reg->pool != NULL )
+    g_thread_pool_free( reg->pool, FALSE, TRUE );
+
+  g_hash_table_destroy( reg->nodes );
+  for ( slot = 0; slot < REG_SHARDS; ++slot )
+    g_hash_table_destroy( reg->shards[slot] );
+  g_free( reg );
+}
+
+/*
+ * Starts replacing the names a node holds with a full list it is sending
+ * us, and renews its lease. The list is fed in with registry_sync_feed()
+ * and takes effect with registry_sync_commit(); until then lookups see
+ * the names the node held before plus the ones fed so far. Only one sync
+ * can be open at a time.
+ *
+ * @param reg   the registry
+ * @param addr  ip address of the node
+ * @param size  bytes the whole list came in as, 0 if we don't know yet
+ *
+ * @return the open sync
+ */
+struct reg_sync *registry_sync_begin( struct registry *reg, const char *addr, gsize size ){
+  struct reg_node *node = g_hash_table_lookup( reg->nodes, addr );
+  struct reg_sync *sync = g_new0( struct reg_sync, 1 );
+
+  if ( node == NULL ) {
+    node = g_new0( struct reg_node, 1 );
+    strncpy( node->addr, addr, NI_MAXHOST - 1 );
+    node->names = g_ptr_array_new();
+    node->capacity = 1;
+    g_hash_table_insert( reg->nodes, node->addr, node );
+  }
+  renew_node( reg, node );
+
+  // A new stamp tells this sync's names from the ones the node dropped
+  reg->stamp ++;
+
+  sync->reg   = reg;
+  sync->node  = node;
+  sync->size  = size;
+  sync->names = g_ptr_array_new();
+  sync->fc    = fc_new();
+  sync->last  = g_string_sized_new( 256 );
+  return sync;
+}
+
+/*
+ * Indexes the next part of a node's list. Other nodes are evicted when
+ * the budget runs out, if there is nobody left to evict the rest of the
+ * list is dropped.
+ *
+ * The part is split by shard and every shard is indexed on its own, by
+ * the thread pool when the sync as a whole is large, see REG_PARALLEL_MIN.
+ * The names are front coded as they come, troute sends them sorted.
+ *
+ * @param sync   the open sync
+ * @param names  the names, see scan_lines()
+ * @param count  number of names
+ */
+void registry_sync_feed( struct reg_sync *sync, struct scan_line *names, guint count ){
+  struct registry *reg = sync->reg;
+  struct reg_node *node = sync->node;
+  struct sync_job jobs[REG_SHARDS];
+  struct reg_name **entries;
+  guint i, pending = 0;
+  bool parallel;
+  GMutex lock;
+  GCond done;
+
+  renew_node( reg, node );
+
+  /*
+   * Make room, the node's old names are still charged until the commit,
+   * or cut the list where the budget ends
+   */
+  for ( i = 0; i < count && !sync->full; ++i ){
+    gsize next = sync->cost + link_cost( names[i].length );
+
+    while ( reg->budget != 0 && reg->bytes - node->bytes + next > reg->budget ){
+      if ( !evict_one( reg, node ) )
+        break;
+    }
+    if ( reg->budget != 0 && reg->bytes - node->bytes + next > reg->budget ) {
+      sync->full = true;
+      break;
+    }
+    sync->cost = next;
+  }
+  if ( sync->full ) {
+    reg->dropped += count - i;
+    count = i;
+  }
+
+  entries = g_new0( struct reg_name *, MAX( count, 1 ) );
+  g_mutex_init( &lock );
+  g_cond_init( &done );
+  for ( i = 0; i < REG_SHARDS; ++i ){
+    jobs[i] = (struct sync_job){ .reg = reg, .node = node, .shard = reg->shards[i],
+      .lines = g_ptr_array_new(), .first = names, .entries = entries,
+      .lock = &lock, .done = &done, .pending = &pending };
+  }
+  for ( i = 0; i < count; ++i )
+    g_ptr_array_add( jobs[names[i].hash >> (64 - REG_SHARD_BITS)].lines, &names[i] );
+
+  // Parts of a large sync come in slices, it is the whole that counts
+  sync->fed += count;
+  parallel = reg->pool != NULL && count >= REG_PARALLEL_PART &&
+      (sync->fed >= REG_PARALLEL_MIN || sync->size >= REG_PARALLEL_BYTES);
+
+  if ( parallel ) {
+    reg->parallel ++;
+    pending = REG_SHARDS;
+    for ( i = 0; i < REG_SHARDS; ++i )
+      g_thread_pool_push( reg->pool, &jobs[i], NULL );
+
+    g_mutex_lock( &lock );
+    while ( pending > 0 )
+      g_cond_wait( &done, &lock );
+    g_mutex_unlock( &lock );
+  } else {
+    for ( i = 0; i < REG_SHARDS; ++i )
+      sync_shard( &jobs[i] );
+  }
+  g_mutex_clear( &lock );
+  g_cond_clear( &done );
+
+  for ( i = 0; i < REG_SHARDS; ++i ){
+    reg->name_count += jobs[i].created;
+    g_ptr_array_free( jobs[i].lines, TRUE );
+  }
+
+  for ( i = 0; i < count; ++i ){
+    if ( entries[i] == NULL )
+      continue;
+    g_ptr_array_add( sync->names, entries[i] );
+
+    if ( sync->unsorted )
+      continue;
+    if ( sync->fc->count > 0 && strcmp( sync->last->str, names[i].name ) >= 0 )
+      sync->unsorted = true;
+    else
+      fc_append( sync->fc, sync->last, names[i].name, names[i].length );
+  }
+  g_free( entries );
+}
+
+/*
+ * A name of a sync and the entry it belongs to, for sorting
+ */
+struct sync_name {
+  char                *name;
+  struct reg_name     *entry;
+};
+
+static gint compare_sync_names( gconstpointer a, gconstpointer b ){
+  return strcmp( ((const struct sync_name *)a)->name, ((const struct sync_name *)b)->name );
+}
+
+/*
+ * Sorts and front codes the names a node sent out of order, the old list
+ * of the node is still there
+ *
+ * @param names  the entries it holds now, sorted on return
+ *
+ * @return the list
+ */
+static struct fc_list *sort_list( GPtrArray *names ){
+  GArray *sorted = g_array_sized_new( FALSE, FALSE, sizeof(struct sync_name), names->len );
+  const char **strings = g_new( const char *, names->len );
+  GString *scratch = g_string_sized_new( 256 );
+  struct fc_list *fc;
+  guint i;
+
+  for ( i = 0; i < names->len; ++i ){
+    struct sync_name item;
+    item.entry = g_ptr_array_index( names, i );
+    item.name  = g_strdup( entry_name( item.entry, scratch ) );
+    g_array_append_val( sorted, item );
+  }
+  g_array_sort( sorted, compare_sync_names );
+
+  for ( i = 0; i < sorted->len; ++i ){
+    strings[i] = g_array_index( sorted, struct sync_name, i ).name;
+    g_ptr_array_index( names, i ) = g_array_index( sorted, struct sync_name, i ).entry;
+  }
+  fc = fc_build( strings, sorted->len );
+
+  for ( i = 0; i < sorted->len; ++i )
+    g_free( g_array_index( sorted, struct sync_name, i ).name );
+
+  g_string_free( scratch, TRUE );
+  g_free( strings );
+  g_array_free( sorted, TRUE );
+  return fc;
+}
+
+/*
+ * Swaps in the list a node holds after a sync. Names that had a copy of
+ * their own or lived in the node's old list move into the new one.
+ *
+ * @param reg    the registry
+ * @param node   the node, its old list is still there
+ * @param names  the entries it holds now, in the order of fc
+ * @param fc     the list
+ */
+static void swap_list( struct registry *reg, struct reg_node *node, GPtrArray *names, struct fc_list *fc ){
+  guint i;
+
+  for ( i = 0; i < names->len; ++i ){
+    struct reg_name *entry = g_ptr_array_index( names, i );
+
+    if ( entry->name != NULL || entry->home == node ) {
+      g_free( entry->name );
+      entry->name  = NULL;
+      entry->home  = node;
+      entry->index = i;
+    }
+  }
+
+  reg->stored -= fc_bytes( node->fc );
+  fc_free( node->fc );
+  node->fc = fc;
+  node->generation = ++ reg->generation;
+  reg->stored += fc_bytes( fc );
+}
+
+/*
+ * Swaps in the list a node sent us, unlinking whatever it no longer holds,
+ * and frees the sync
+ *
+ * @param sync the open sync
+ */
+void registry_sync_commit( struct reg_sync *sync ){
+  struct registry *reg = sync->reg;
+  struct reg_node *node = sync->node;
+  guint i;
+
+  for ( i = 0; i < node->names->len; ++i ){
+    struct reg_name *entry = g_ptr_array_index( node->names, i );
+    if ( entry->stamp != reg->stamp )
+      unlink_name( reg, entry, node );
+  }
+
+  if ( sync->unsorted ) {
+    fc_free( sync->fc );
+    sync->fc = sort_list( sync->names );
+  }
+  swap_list( reg, node, sync->names, sync->fc );
+  g_string_free( sync->last, TRUE );
+  g_ptr_array_free( node->names, TRUE );
+  node->names = sync->names;
+
+  reg->bytes  -= node->bytes;
+  node->bytes  = sync->cost;
+  reg->bytes  += sync->cost;
+
+  renew_node( reg, node );
+  g_free( sync );
+}
+
+/*
+ * Commits a sync that was cut short: the node keeps the names it held
+ * before on top of the ones fed, and frees the sync
+ *
+ * @param sync the open sync
+ */
+void registry_sync_merge( struct reg_sync *sync ){
+  struct registry *reg = sync->reg;
+  struct reg_node *node = sync->node;
+  GString *scratch = g_string_sized_new( 256 );
+  guint i;
+
+  for ( i = 0; i < node->names->len; ++i ){
+    struct reg_name *entry = g_ptr_array_index( node->names, i );
+
+    if ( entry->stamp == reg->stamp )
+      continue;
+    entry->stamp = reg->stamp;
+    g_ptr_array_add( sync->names, entry );
+    sync->cost += link_cost( strlen( entry_name( entry, scratch ) ) );
+  }
+  g_string_free( scratch, TRUE );
+
+  // The old names go anywhere in the list
+  sync->unsorted = true;
+  registry_sync_commit( sync );
+}
+
+/*
+ * Replaces the names a node holds with a full list in one go
+ *
+ * @param reg    the registry
+ * @param addr   ip address of the node
+ * @param names  the names it holds, see scan_lines()
+ * @param count  number of names
+ */
+void registry_sync( struct registry *reg, const char *addr, struct scan_line *names, guint count ){
+  struct reg_sync *sync = registry_sync_begin( reg, addr, 0 );
+
+  registry_sync_feed( sync, names, count );
+  registry_sync_commit( sync );
+}
+
+/*
+ * How much a node's list may take once we made all the room we can: the
+ * budget, less what the node of the open sync is charged for, it is the
+ * only one we can't evict. A node always has room for its own charge.
+ *
+ * @param reg   the registry
+ * @param open  the open sync, NULL if there is none
+ * @param addr  ip address of the node
+ *
+ * @return bytes, 0 without a budget
+ */
+gsize registry_room( const struct registry *reg, const struct reg_sync *open, const char *addr ){
+  gsize pinned = 0;
+
+  if ( open != NULL && strcmp( open->node->addr, addr ) != 0 )
+    pinned = MAX( open->node->bytes, open->cost );
+  return reg->budget > pinned ? reg->budget - pinned : 0;
+}
+
+/*
+ * Renews the lease of a node that sent us a heartbeat
+ *
+ * @param reg   the registry
+ * @param addr  ip address of the node
+ *
+ * @return false if we don't know the node, it has to send its names again
+ */
+bool registry_renew( struct registry *reg, const char *addr ){
+  struct reg_node *node = g_hash_table_lookup( reg->nodes, addr );
+
+  if ( node == NULL )
+    return false;
+
+  renew_node( reg, node );
+  return true;
+}
+
+/*
+ * Drops a node as if its lease ran out, e.g. because a primary we
+ * replicate dropped it
+ *
+ * @param reg   the registry
+ * @param addr  ip address of the node
+ *
+ * @return false if we didn't know the node
+ */
+bool registry_drop( struct registry *reg, const char *addr ){
+  struct reg_node *node = g_hash_table_lookup( reg->nodes, addr );
+
+  if ( node == NULL )
+    return false;
+
+  expire_node( reg, node );
+  return true;
+}
+
+/*
+ * Remembers the load figures a node sent along with its names or heartbeat
+ *
+ * @param reg       the registry
+ * @param addr      ip address of the node
+ * @param load      how busy the node is, e.g. its load average
+ * @param capacity  how much it can take, e.g. its number of cpus
+ */
+void registry_report( struct registry *reg, const char *addr, double load, double capacity ){
+  struct reg_node *node = g_hash_table_lookup( reg->nodes, addr );
+
+  if ( node == NULL || capacity <= 0 || load < 0 )
+    return;
+  if ( node->load == load && node->capacity == capacity )
+    return;
+
+  node->load       = load;
+  node->capacity   = capacity;
+  node->load_epoch = ++ reg->load_epoch;
+}
+
+/*
+ * Scores a node for ranking, lower is better. Nodes that never reported
+ * anything score 1, as busy as a single cpu with nothing running.
+ *
+ * @param node the node
+ */
+double registry_score( const struct reg_node *node ){
+  return (node->load + 1) / node->capacity;
+}
+
+/*
+ * Settles the version an answer for a name goes out under. An answer that
+ * says something else than the last one under the current version, as a
+ * holder's lease ran out or load reports reordered the holders, gets a
+ * new version: two different answers never share a name.
+ *
+ * @param entry        the name
+ * @param fingerprint  hash of the answer
+ *
+ * @return the version
+ */
+guint64 registry_answered( struct reg_name *entry, guint64 fingerprint ){
+  if ( entry->answered != fingerprint ) {
+    if ( entry->answered != 0 )
+      bump_version( entry );
+    entry->answered = fingerprint;
+  }
+  return entry->version;
+}
+
+/*
+ * Finds a name, holders that are being reclaimed are still in the list
+ * and have expired set
+ *
+ * @param reg   the registry
+ * @param name  the name we are looking for
+ *
+ * @return the entry, or NULL if nobody holds the name
+ */
+struct reg_name *registry_lookup( struct registry *reg, const char *name ){
+  struct reg_name probe = { .name = (char*)name };
+
+  probe.hash = scan_hash( name, strlen( name ) );
+  return g_hash_table_lookup( shard_of( reg, probe.hash ), &probe );
+}
+
+/*
+ * Moves the timer wheel up to now, and unlinks at most budget names of
+ * nodes whose lease ran out. Called every tick of the main loop so a big
+ * node going away never stalls us.
+ *
+ * @param reg     the registry
+ * @param now     monotonic time in usec
+ * @param budget  number of names we may unlink
+ *
+ * @return number of names unlinked
+ */
+guint registry_expire( struct registry *reg, gint64 now, guint budget ){
+  struct timer_wheel *wheel = &reg->wheel;
+  guint64 target = now / TICK_USEC;
+  guint done = 0;
+
+  while ( wheel->now <= target ){
+    int index = wheel->now & WHEEL_MASK;
+    struct reg_node *node;
+    int level;
+
+    for ( level = 1; index == 0 && level < WHEEL_LEVELS; ++level )
+      index = wheel_cascade( wheel, level, (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK );
+
+    GQueue *slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+    while ( (node = g_queue_pop_head( slot )) != NULL ){
+      node->wheel_slot = NULL;
+      node->wheel_link = NULL;
+
+      if ( node->lease_expiry / TICK_USEC > wheel->now ) {
+        wheel_insert( wheel, node );
+        continue;
+      }
+
+      fprintf( stderr, "Expire : %s\n", node->addr );
+      expire_node( reg, node );
+      reg->expired ++;
+    }
+
+    wheel->now ++;
+  }
+
+  while ( done < budget && !g_queue_is_empty( &reg->reclaim ) ){
+    struct reg_node *node = g_queue_peek_head( &reg->reclaim );
+
+    while ( done < budget && node->names->len > 0 ){
+      struct reg_name *entry = g_ptr_array_remove_index_fast( node->names, node->names->len - 1 );
+      unlink_name( reg, entry, node );
+      done ++;
+    }
+
+    if ( node->names->len == 0 ) {
+      g_queue_pop_head( &reg->reclaim );
+      free_node( reg, node );
+    }
+  }
+
+  return done;
+}
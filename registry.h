@@ -0,0 +1,190 @@
+/*
+ * Registry of which node holds which name. Every node holds a lease that
+ * a registration or a heartbeat renews, expired leases are kept on a
+ * hierarchical timer wheel and reclaimed a few names at a time.
+ */
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdbool.h>
+#include <netdb.h>
+
+#include <glib.h>
+
+#include "scan.h"
+#include "fcode.h"
+
+#define WHEEL_BITS    8
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS  3
+
+/*
+ * The names index is split in shards that a large sync fills in parallel.
+ * A sync is large once REG_PARALLEL_MIN names were fed, or when it came in
+ * with REG_PARALLEL_BYTES or more; its parts go to the pool from then on,
+ * those of at least REG_PARALLEL_PART names.
+ */
+#define REG_SHARD_BITS    4
+#define REG_SHARDS        (1 << REG_SHARD_BITS)
+#define REG_PARALLEL_MIN  65536
+#define REG_PARALLEL_BYTES (1024*1024)
+#define REG_PARALLEL_PART 4096
+
+/*
+ * A name somebody registered. The name itself lives in the front coded
+ * list of one of its holders, only names no holder has committed yet have
+ * their own copy.
+ *
+ * @param name     our own copy of the name, or NULL
+ * @param home     the holder whose list has the name, when name is NULL
+ * @param index    where the name is in that list
+ * @param hash     scan_hash() of the name, picks the shard
+ * @param version  version of the answer for it, moves when holders come or
+ *                 go, and when the answer changes, see registry_answered()
+ * @param answered hash of the last answer under version, 0 for none yet
+ * @param holders  struct reg_node pointers of the nodes holding it
+ * @param stamp    sync that last saw the name, see registry_sync()
+ */
+struct reg_name {
+  char        *name;
+  struct reg_node *home;
+  guint        index;
+  guint64      hash;
+  guint64      version;
+  guint64      answered;
+  GPtrArray   *holders;
+  guint        stamp;
+};
+
+/*
+ * A node that registered names with us
+ *
+ * @param addr          ip address of the node
+ * @param names         struct reg_name pointers the node holds
+ * @param fc            its names front coded, as of the last sync
+ * @param generation    generation of the registry when fc was swapped in
+ * @param lease_expiry  monotonic time (usec) at which the lease runs out
+ * @param bytes         memory charged to this node
+ * @param expired       the lease ran out, names are being reclaimed
+ * @param load          load the node last reported
+ * @param capacity      capacity the node last reported
+ * @param load_epoch    load_epoch of the registry when they last changed, or
+ *                      when the lease ran out
+ */
+struct reg_node {
+  char         addr[NI_MAXHOST];
+  GPtrArray   *names;
+  struct fc_list *fc;
+  guint64      generation;
+  gint64       lease_expiry;
+  gsize        bytes;
+  bool         expired;
+
+  double       load;
+  double       capacity;
+  guint64      load_epoch;
+
+  /* where the node sits on the timer wheel and the lru queue */
+  GQueue      *wheel_slot;
+  GList       *wheel_link;
+  GList       *lru_link;
+};
+
+/*
+ * Hierarchical timer wheel with one second ticks, level n slots span
+ * WHEEL_SLOTS^n ticks and get cascaded down as time moves on.
+ */
+struct timer_wheel {
+  GQueue       slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  guint64      now;
+};
+
+/*
+ * The registry
+ *
+ * @param shards   sets of struct reg_name, by the top bits of the hash
+ * @param nodes    char* addr -> struct reg_node, only nodes with a live lease
+ * @param lru      live nodes, least recently renewed first
+ * @param reclaim  nodes whose lease ran out, waiting to be unlinked
+ * @param lease    lease duration (usec)
+ * @param bytes    memory charged to live nodes
+ * @param budget   limit on bytes, 0 for none
+ * @param stored   memory the front coded lists of all nodes take
+ * @param pool     workers filling shards for large syncs
+ * @param parallel parts of syncs the pool indexed
+ * @param load_epoch  moves whenever a node reports different load figures
+ *                    or its lease runs out
+ * @param generation  moves whenever the list of a node is swapped
+ * @param on_drop  called when a node's lease runs out or it is evicted
+ */
+struct registry {
+  GHashTable          *shards[REG_SHARDS];
+  guint                name_count;
+  GHashTable          *nodes;
+  GQueue               lru;
+  GQueue               reclaim;
+  struct timer_wheel   wheel;
+
+  gint64               lease;
+  gsize                bytes;
+  gsize                budget;
+  gsize                stored;
+
+  GThreadPool         *pool;
+  guint                stamp;
+  guint64              load_epoch;
+  guint64              generation;
+
+  unsigned long        expired;
+  unsigned long        evicted;
+  unsigned long        dropped;
+  unsigned long        parallel;
+
+  void               (*on_drop)( struct reg_node *node, void *data );
+  void                *on_drop_data;
+};
+
+/*
+ * A full list of names that is being indexed a part at a time
+ *
+ * @param names     entries fed so far, the node's list after the commit
+ * @param fc        the names fed so far front coded, in the same order
+ * @param last      the last name in fc
+ * @param unsorted  names didn't come in order, fc is rebuilt at the commit
+ * @param cost      memory charged for them
+ * @param full      the budget ran out, the rest of the list is dropped
+ * @param size      bytes the whole list came in as, 0 if we don't know
+ * @param fed       names fed so far
+ */
+struct reg_sync {
+  struct registry     *reg;
+  struct reg_node     *node;
+  GPtrArray           *names;
+  struct fc_list      *fc;
+  GString             *last;
+  bool                 unsorted;
+  gsize                cost;
+  bool                 full;
+  gsize                size;
+  guint                fed;
+};
+
+struct registry *registry_new( int lease, gsize budget );
+void registry_destroy( struct registry *reg );
+
+void registry_sync( struct registry *reg, const char *addr, struct scan_line *names, guint count );
+struct reg_sync *registry_sync_begin( struct registry *reg, const char *addr, gsize size );
+void registry_sync_feed( struct reg_sync *sync, struct scan_line *names, guint count );
+void registry_sync_commit( struct reg_sync *sync );
+void registry_sync_merge( struct reg_sync *sync );
+gsize registry_room( const struct registry *reg, const struct reg_sync *open, const char *addr );
+bool registry_renew( struct registry *reg, const char *addr );
+bool registry_drop( struct registry *reg, const char *addr );
+void registry_report( struct registry *reg, const char *addr, double load, double capacity );
+double registry_score( const struct reg_node *node );
+guint64 registry_answered( struct reg_name *entry, guint64 fingerprint );
+struct reg_name *registry_lookup( struct registry *reg, const char *name );
+guint registry_expire( struct registry *reg, gint64 now, guint budget );
+
+#endif
@@ -0,0 +1,815 @@
+/*
+ * Change log shipping from a primary publisher to its read replicas, see
+ * replica.h
+ */
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include "replica.h"
+#include "fcode.h"
+#include "scan.h"
+
+#define REPL_READ_BUDGET (4*1024*1024)
+
+/* Bytes of names a replica feeds its registry at once, well within a slice */
+#define REPL_FEED_BYTES  (256*1024)
+
+/* Names we stream, or lines we apply, between looks at the clock */
+#define STREAM_CHECK     256
+
+static void free_record( struct repl_record *rec ){
+  g_string_free( rec->data, TRUE );
+  g_free( rec->addr );
+  g_free( rec );
+}
+
+static void close_peer( gpointer data ){
+  struct repl_peer *peer = data;
+  close( peer->fd );
+  g_string_free( peer->out, TRUE );
+  g_string_free( peer->last, TRUE );
+  if ( peer->snapshot != NULL )
+    g_ptr_array_free( peer->snapshot, TRUE );
+  g_free( peer );
+}
+
+/*
+ * Decides whether a change gets logged: somebody follows us, or did a
+ * moment ago and may be back. Otherwise the change only takes a sequence
+ * number, and the log is let go.
+ *
+ * @param p the primary
+ *
+ * @return true if the caller logs the change
+ */
+static bool log_change( struct repl_primary *p ){
+  struct repl_record *rec;
+
+  if ( p->peers->len > 0 || g_get_monotonic_time() < p->keep_until )
+    return true;
+
+  while ( (rec = g_queue_pop_head( &p->records )) != NULL )
+    free_record( rec );
+  p->bytes = 0;
+  p->head ++;
+  return false;
+}
+
+/*
+ * Starts a record with the next sequence number, the caller appends the
+ * rest of the header line and hands it to record_end()
+ *
+ * @param p     the primary
+ * @param kind  sync, renew, load or drop
+ */
+static GString *record_begin( struct repl_primary *p, const char *kind ){
+  GString *data = g_string_new( NULL );
+  g_string_printf( data, "!seq %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %s",
+      p->head + 1, g_get_real_time(), kind );
+  return data;
+}
+
+/*
+ * Logs a record, letting go of the oldest ones once the log is over its
+ * limit. The newest record always stays.
+ *
+ * @param addr  the node whose names follow the record, NULL for none
+ */
+static void record_end( struct repl_primary *p, GString *data, const char *addr ){
+  struct repl_record *rec = g_new( struct repl_record, 1 );
+
+  rec->seq  = ++p->head;
+  rec->data = data;
+  rec->addr = addr != NULL ? g_strdup( addr ) : NULL;
+  g_queue_push_tail( &p->records, rec );
+  p->bytes += data->len;
+
+  while ( p->bytes > p->limit && p->records.length > 1 ){
+    struct repl_record *old = g_queue_pop_head( &p->records );
+    p->bytes -= old->data->len;
+    free_record( old );
+  }
+}
+
+/*
+ * Logs a node the registry dropped, registry on_drop hook
+ */
+static void log_drop( struct reg_node *node, void *data ){
+  struct repl_primary *p = data;
+  GString *out;
+
+  if ( !log_change( p ) )
+    return;
+
+  out = record_begin( p, "drop" );
+  g_string_append_printf( out, " %s\n", node->addr );
+  record_end( p, out, NULL );
+}
+
+/*
+ * Sets up the primary side, and hooks into the registry for dropped nodes.
+ * Nothing is logged until a replica subscribes.
+ *
+ * @param p      the primary
+ * @param reg    the registry we ship
+ * @param limit  bytes of records we keep at most
+ */
+void repl_primary_init( struct repl_primary *p, struct registry *reg, gsize limit ){
+  memset( p, 0, sizeof(*p) );
+  p->reg   = reg;
+  p->limit = limit;
+  p->head  = g_get_real_time();
+  p->peers = g_ptr_array_new_with_free_func( close_peer );
+  p->allowed = g_ptr_array_new_with_free_func( g_free );
+  g_queue_init( &p->records );
+
+  reg->on_drop      = log_drop;
+  reg->on_drop_data = p;
+}
+
+void repl_primary_clear( struct repl_primary *p ){
+  struct repl_record *rec;
+
+  p->reg->on_drop = NULL;
+  while ( (rec = g_queue_pop_head( &p->records )) != NULL )
+    free_record( rec );
+  g_ptr_array_free( p->peers, TRUE );
+  g_ptr_array_free( p->allowed, TRUE );
+}
+
+/*
+ * Lets the replica at an address follow us
+ *
+ * @param p     the primary
+ * @param addr  ip address of the replica, numeric
+ */
+void repl_primary_allow( struct repl_primary *p, const char *addr ){
+  g_ptr_array_add( p->allowed, g_strdup( addr ) );
+}
+
+/*
+ * Logs that a node's sync was committed, its names go out with the record
+ *
+ * @param p     the primary
+ * @param addr  ip address of the node
+ */
+void repl_log_sync( struct repl_primary *p, const char *addr ){
+  GString *out;
+
+  if ( !log_change( p ) )
+    return;
+
+  out = record_begin( p, "sync" );
+  g_string_append_printf( out, " %s\n", addr );
+  record_end( p, out, addr );
+}
+
+void repl_log_renew( struct repl_primary *p, const char *addr ){
+  GString *out;
+
+  if ( !log_change( p ) )
+    return;
+
+  out = record_begin( p, "renew" );
+  g_string_append_printf( out, " %s\n", addr );
+  record_end( p, out, NULL );
+}
+
+void repl_log_load( struct repl_primary *p, const char *addr, double load, double capacity ){
+  GString *out;
+
+  if ( !log_change( p ) )
+    return;
+
+  out = record_begin( p, "load" );
+  g_string_append_printf( out, " %s %f %f\n", addr, load, capacity );
+  record_end( p, out, NULL );
+}
+
+/*
+ * @return true if a replica that needs next on can be served from the log
+ */
+static bool in_log( struct repl_primary *p, guint64 next ){
+  struct repl_record *oldest = g_queue_peek_head( &p->records );
+
+  if ( next == p->head + 1 )
+    return true;
+  return oldest != NULL && oldest->seq <= next && next <= p->head;
+}
+
+/*
+ * Starts streaming the names of a node, the record header is queued already
+ */
+static void stream_begin( struct repl_peer *peer, const char *addr ){
+  g_strlcpy( peer->node, addr, NI_MAXHOST );
+  peer->generation = 0;
+  peer->index      = 0;
+  peer->sent       = 0;
+  g_string_truncate( peer->last, 0 );
+}
+
+/*
+ * Streams the names of a node front coded, decoding its list in order,
+ * until the queue holds limit bytes or the deadline passed. The record
+ * ends after the last name, or right away if the node is gone.
+ *
+ * @param p         the primary
+ * @param peer      the replica
+ * @param limit     bytes we queue at most
+ * @param deadline  monotonic time we stop at
+ *
+ * @return true once the record ended
+ */
+static bool stream_node( struct repl_primary *p, struct repl_peer *peer, gsize limit, gint64 deadline ){
+  struct reg_node *node = g_hash_table_lookup( p->reg->nodes, peer->node );
+  const struct fc_list *fc = node != NULL ? node->fc : NULL;
+  GString *name = g_string_sized_new( 256 );
+  struct fc_iter iter;
+
+  // Swapped since, carry on after the last name we sent
+  if ( node != NULL && node->generation != peer->generation ) {
+    if ( peer->sent > 0 )
+      peer->index = fc_upper( fc, peer->last->str );
+    peer->generation = node->generation;
+  }
+
+  fc_iter_init( &iter, fc, peer->index, name );
+  while ( peer->out->len < limit && fc_iter_next( &iter ) ){
+    fc_encode_line( peer->out, peer->last->str, name->str, peer->sent++ );
+    g_string_assign( peer->last, name->str );
+    if ( peer->sent % STREAM_CHECK == 0 && g_get_monotonic_time() >= deadline )
+      break;
+  }
+  peer->index = iter.index;
+  g_string_free( name, TRUE );
+
+  if ( fc != NULL && peer->index < fc->count )
+    return false;
+
+  g_string_append( peer->out, "!end\n" );
+  peer->node[0] = '\0';
+  return true;
+}
+
+/*
+ * Starts a snapshot for a replica, the nodes are streamed one after the
+ * other and it continues from the log after
+ *
+ * @param p     the primary
+ * @param peer  the replica, not streaming anything
+ */
+static void snapshot_begin( struct repl_primary *p, struct repl_peer *peer ){
+  GHashTableIter iter;
+  gpointer key;
+
+  peer->snapshot = g_ptr_array_new_with_free_func( g_free );
+  g_hash_table_iter_init( &iter, p->reg->nodes );
+  while ( g_hash_table_iter_next( &iter, &key, NULL ) )
+    g_ptr_array_add( peer->snapshot, g_strdup( key ) );
+  peer->snapshot_seq = p->head;
+
+  g_string_append_printf( peer->out, "!snapshot %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+      peer->snapshot_seq, g_get_real_time() );
+  p->snapshots ++;
+  fprintf( stderr, "Replica : snapshot of %u nodes for %s\n", peer->snapshot->len, peer->addr );
+}
+
+/*
+ * Queues the next node of a snapshot, or its end
+ */
+static void snapshot_next( struct repl_primary *p, struct repl_peer *peer ){
+  const char *addr;
+
+  if ( peer->snapshot->len == 0 ) {
+    g_string_append( peer->out, "!snapshot-end\n" );
+    peer->next = peer->snapshot_seq + 1;
+    g_ptr_array_free( peer->snapshot, TRUE );
+    peer->snapshot = NULL;
+    return;
+  }
+
+  // Nodes gone since are left out, the replica drops them at the end
+  addr = g_ptr_array_index( peer->snapshot, peer->snapshot->len - 1 );
+  if ( g_hash_table_contains( p->reg->nodes, addr ) ) {
+    g_string_append_printf( peer->out, "!seq %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " sync %s\n",
+        peer->snapshot_seq, g_get_real_time(), addr );
+    stream_begin( peer, addr );
+  }
+  g_ptr_array_remove_index_fast( peer->snapshot, peer->snapshot->len - 1 );
+}
+
+/*
+ * Takes over a connection that sent "!replicate <seq>", if it comes from
+ * an address we allowed
+ *
+ * @param p     the primary
+ * @param fd    the connection, non blocking, ours from now on if we take it
+ * @param addr  ip address of the replica
+ * @param line  what it sent
+ *
+ * @return false if we don't, the connection stays the caller's
+ */
+bool repl_primary_subscribe( struct repl_primary *p, int fd, const char *addr, const char *line ){
+  struct repl_peer *peer;
+  guint64 applied = 0;
+  guint i;
+
+  for ( i = 0; i < p->allowed->len; ++i )
+    if ( strcmp( g_ptr_array_index( p->allowed, i ), addr ) == 0 )
+      break;
+  if ( i == p->allowed->len ) {
+    fprintf( stderr, "Replica : refused %s, not allowed to replicate\n", addr );
+    p->refused ++;
+    return false;
+  }
+
+  peer = g_new0( struct repl_peer, 1 );
+  peer->fd   = fd;
+  peer->out  = g_string_new( NULL );
+  peer->last = g_string_new( NULL );
+  g_strlcpy( peer->addr, addr, NI_MAXHOST );
+
+  sscanf( line, REPL_DIRECTIVE " %" G_GUINT64_FORMAT, &applied );
+  peer->next = applied + 1;
+  fprintf( stderr, "Replica : %s subscribed after %" G_GUINT64_FORMAT ", head %" G_GUINT64_FORMAT "\n",
+      addr, applied, p->head );
+
+  // Too far behind, or it replicated an earlier run of ours
+  if ( !in_log( p, peer->next ) )
+    snapshot_begin( p, peer );
+
+  g_ptr_array_add( p->peers, peer );
+  return true;
+}
+
+/*
+ * @return how many replicas follow us from an address, they count
+ *         towards its connections
+ */
+guint repl_primary_peers( const struct repl_primary *p, const char *addr ){
+  guint i, count = 0;
+
+  for ( i = 0; i < p->peers->len; ++i )
+    count += strcmp( ((struct repl_peer *)g_ptr_array_index( p->peers, i ))->addr, addr ) == 0;
+  return count;
+}
+
+/*
+ * Queues what a replica needs next once it got everything queued before:
+ * the rest of the names we are streaming, the next node of its snapshot,
+ * the next records of the log. Up to REPL_BATCH bytes, REPL_MIN_BATCH
+ * once the deadline passed.
+ *
+ * @param p         the primary
+ * @param peer      the replica
+ * @param deadline  monotonic time the slice ends
+ */
+static void fill_peer( struct repl_primary *p, struct repl_peer *peer, gint64 deadline ){
+  GList *link = NULL;
+
+  g_string_truncate( peer->out, 0 );
+  peer->offset = 0;
+
+  while ( true ){
+    gsize limit = g_get_monotonic_time() < deadline ? REPL_BATCH : REPL_MIN_BATCH;
+    struct repl_record *rec;
+
+    if ( peer->out->len >= limit )
+      break;
+
+    if ( peer->node[0] != '\0' ) {
+      stream_node( p, peer, limit, deadline );
+      continue;
+    }
+    if ( peer->snapshot != NULL ) {
+      snapshot_next( p, peer );
+      continue;
+    }
+
+    if ( peer->next > p->head )
+      break;
+    if ( !in_log( p, peer->next ) ) {
+      snapshot_begin( p, peer );
+      continue;
+    }
+
+    // Nothing is logged while we fill, the link stays good
+    if ( link == NULL || ((struct repl_record *)link->data)->seq != peer->next ) {
+      rec  = g_queue_peek_head( &p->records );
+      link = g_queue_peek_nth_link( &p->records, peer->next - rec->seq );
+    }
+    rec = link->data;
+    link = link->next;
+
+    g_string_append_len( peer->out, rec->data->str, rec->data->len );
+    peer->next = rec->seq + 1;
+    if ( rec->addr != NULL )
+      stream_begin( peer, rec->addr );
+  }
+}
+
+/*
+ * Sends the replicas what they miss, without blocking. What we queue is
+ * streamed out of the registry within the ingest slice. Replicas that
+ * hung up are dropped, they subscribe again.
+ *
+ * @param p         the primary
+ * @param deadline  monotonic time the slice ends
+ */
+void repl_primary_run( struct repl_primary *p, gint64 deadline ){
+  gint64 now = g_get_monotonic_time();
+  bool head = now >= p->next_head;
+  guint i;
+
+  if ( head )
+    p->next_head = now + (gint64)REPL_HEAD_INTERVAL * G_USEC_PER_SEC;
+
+  for ( i = p->peers->len; i-- > 0; ){
+    struct repl_peer *peer = g_ptr_array_index( p->peers, i );
+    bool failed = false;
+
+    if ( peer->offset == peer->out->len )
+      fill_peer( p, peer, deadline );
+
+    // Never in the middle of the names of a node
+    if ( head && peer->node[0] == '\0' )
+      g_string_append_printf( peer->out, "!head %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+          p->head, g_get_real_time() );
+
+    while ( peer->offset < peer->out->len ){
+      ssize_t sent = send( peer->fd, peer->out->str + peer->offset, peer->out->len - peer->offset,
+          MSG_DONTWAIT | MSG_NOSIGNAL );
+      if ( sent < 0 ) {
+        failed = errno != EAGAIN && errno != EWOULDBLOCK;
+        break;
+      }
+      peer->offset += sent;
+    }
+
+    if ( failed ) {
+      fprintf( stderr, "Replica : %s is gone\n", peer->addr );
+      g_ptr_array_remove_index_fast( p->peers, i );
+      if ( p->peers->len == 0 )
+        p->keep_until = g_get_monotonic_time() + (gint64)REPL_LOG_KEEP * G_USEC_PER_SEC;
+    }
+  }
+}
+
+/*
+ * Feeds the names of the sync record decoded so far
+ */
+static void sync_feed( struct repl_replica *r ){
+  if ( r->sync == NULL || r->plain->len == 0 )
+    return;
+
+  g_array_set_size( r->lines, 0 );
+  scan_lines( r->plain->str, r->plain->len, r->lines );
+  registry_sync_feed( r->sync, (struct scan_line*)r->lines->data, r->lines->len );
+  g_string_truncate( r->plain, 0 );
+}
+
+/*
+ * Starts taking in the names of a sync record, they replace the ones of
+ * the node as they come
+ *
+ * @param fresh  we didn't apply the record yet, otherwise the names are skipped
+ */
+static void sync_begin( struct repl_replica *r, guint64 seq, gint64 usec, const char *addr, bool fresh ){
+  r->syncing   = true;
+  r->sync_seq  = seq;
+  r->sync_time = usec;
+  g_strlcpy( r->sync_addr, addr, NI_MAXHOST );
+  g_string_truncate( r->previous, 0 );
+  g_string_truncate( r->plain, 0 );
+  r->sync = fresh ? registry_sync_begin( r->reg, addr, 0 ) : NULL;
+}
+
+/*
+ * Remembers the last record we applied, the ones of a snapshot only count
+ * once it is complete
+ */
+static void record_applied( struct repl_replica *r, guint64 seq, gint64 usec ){
+  if ( r->snapshot == NULL && seq > r->applied ) {
+    r->applied      = seq;
+    r->applied_time = usec;
+    r->records ++;
+  }
+}
+
+/*
+ * All names of a sync record are in
+ */
+static void sync_end( struct repl_replica *r ){
+  if ( r->sync != NULL ) {
+    sync_feed( r );
+    registry_sync_commit( r->sync );
+    r->sync = NULL;
+  }
+  r->syncing = false;
+
+  if ( r->snapshot != NULL )
+    g_hash_table_add( r->snapshot, g_strdup( r->sync_addr ) );
+  record_applied( r, r->sync_seq, r->sync_time );
+}
+
+/*
+ * A sync record that was cut short leaves the node with the names it had
+ * and the ones that came in, the record is sent again in full
+ */
+static void sync_abandon( struct repl_replica *r ){
+  if ( r->sync != NULL ) {
+    sync_feed( r );
+    registry_sync_merge( r->sync );
+    r->sync = NULL;
+  }
+  r->syncing = false;
+}
+
+/*
+ * Sets up the replica side, it connects on the first run
+ *
+ * @param r        the replica
+ * @param reg      the registry we fill
+ * @param primary  "host:port" of the primary
+ */
+void repl_replica_init( struct repl_replica *r, struct registry *reg, const char *primary ){
+  memset( r, 0, sizeof(*r) );
+  r->reg = reg;
+  r->fd  = -1;
+  r->in  = g_string_new( NULL );
+  r->previous = g_string_new( NULL );
+  r->plain    = g_string_new( NULL );
+  r->lines    = g_array_new( FALSE, FALSE, sizeof(struct scan_line) );
+  g_strlcpy( r->primary, primary, sizeof(r->primary) );
+}
+
+void repl_replica_clear( struct repl_replica *r ){
+  if ( r->fd >= 0 )
+    close( r->fd );
+  sync_abandon( r );
+  if ( r->snapshot != NULL )
+    g_hash_table_destroy( r->snapshot );
+  g_string_free( r->in, TRUE );
+  g_string_free( r->previous, TRUE );
+  g_string_free( r->plain, TRUE );
+  g_array_free( r->lines, TRUE );
+}
+
+/*
+ * Starts connecting to the primary, replica_connected() finishes
+ */
+static void replica_connect( struct repl_replica *r ){
+  struct sockaddr_in serv;
+  char host[NI_MAXHOST];
+  int port, fd;
+
+  memset( &serv, 0, sizeof(serv) );
+  if ( sscanf( r->primary, "%1024[^:]:%d", host, &port ) != 2 || inet_aton( host, &serv.sin_addr ) == 0 ) {
+    fprintf( stderr, "Replica : bad primary %s\n", r->primary );
+    return;
+  }
+
+  serv.sin_family = AF_INET;
+  serv.sin_port   = htons( port );
+  fd = socket(AF_INET,SOCK_STREAM,0);
+  if ( fd < 0 )
+    return;
+
+  fcntl( fd, F_SETFL, O_NONBLOCK );
+  if ( connect( fd, (struct sockaddr*)&serv, sizeof(serv) ) < 0 && errno != EINPROGRESS ){
+    close( fd );
+    return;
+  }
+
+  r->fd = fd;
+  r->connected = false;
+  r->connect_deadline = g_get_monotonic_time() + (gint64)REPL_CONNECT_TIMEOUT * G_USEC_PER_SEC;
+}
+
+/*
+ * Checks on a connect in progress, once it went through asks for
+ * everything after what we applied
+ *
+ * @param r    the replica
+ * @param now  monotonic time
+ *
+ * @return true once we are connected, the connection is closed if it failed
+ */
+static bool replica_connected( struct repl_replica *r, gint64 now ){
+  struct pollfd pfd = { .fd = r->fd, .events = POLLOUT };
+  socklen_t length = sizeof(int);
+  char request[64];
+  int error = 0, len;
+
+  if ( poll( &pfd, 1, 0 ) == 0 ) {
+    if ( now < r->connect_deadline )
+      return false;
+    error = ETIMEDOUT;
+  } else if ( getsockopt( r->fd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 ) {
+    error = errno;
+  }
+
+  // The request is tiny, a fresh connection always has room for it
+  len = snprintf( request, sizeof(request), REPL_DIRECTIVE " %" G_GUINT64_FORMAT "\n", r->applied );
+  if ( error == 0 && send( r->fd, request, len, MSG_NOSIGNAL ) != len )
+    error = errno;
+
+  if ( error != 0 ) {
+    close( r->fd );
+    r->fd = -1;
+    return false;
+  }
+
+  r->connected = true;
+  r->connects ++;
+  g_string_truncate( r->in, 0 );
+  fprintf( stderr, "Replica : following %s after %" G_GUINT64_FORMAT "\n", r->primary, r->applied );
+  return true;
+}
+
+static void replica_disconnect( struct repl_replica *r ){
+  close( r->fd );
+  r->fd = -1;
+  r->connected = false;
+  sync_abandon( r );
+  if ( r->snapshot != NULL ) {
+    g_hash_table_destroy( r->snapshot );
+    r->snapshot = NULL;
+  }
+  fprintf( stderr, "Replica : lost %s\n", r->primary );
+}
+
+/*
+ * Drops the nodes the snapshot that just came in doesn't have
+ */
+static void finish_snapshot( struct repl_replica *r ){
+  GPtrArray *gone = g_ptr_array_new_with_free_func( g_free );
+  GHashTableIter iter;
+  gpointer key;
+  guint i;
+
+  g_hash_table_iter_init( &iter, r->reg->nodes );
+  while ( g_hash_table_iter_next( &iter, &key, NULL ) )
+    if ( !g_hash_table_contains( r->snapshot, key ) )
+      g_ptr_array_add( gone, g_strdup( key ) );
+  for ( i = 0; i < gone->len; ++i )
+    registry_drop( r->reg, g_ptr_array_index( gone, i ) );
+
+  fprintf( stderr, "Replica : snapshot %" G_GUINT64_FORMAT " of %u nodes, dropped %u\n",
+      r->snapshot_seq, g_hash_table_size( r->snapshot ), gone->len );
+
+  r->applied      = r->snapshot_seq;
+  r->applied_time = r->snapshot_time;
+  r->snapshots ++;
+  g_hash_table_destroy( r->snapshot );
+  r->snapshot = NULL;
+  g_ptr_array_free( gone, TRUE );
+}
+
+/*
+ * Applies the complete lines we read until the deadline, the rest waits
+ * for the next tick, an incomplete line for more. The names of a sync
+ * record are fed as they come, a part at a time.
+ *
+ * @param r         the replica
+ * @param deadline  monotonic time the slice ends
+ */
+static void apply_records( struct repl_replica *r, gint64 deadline ){
+  gsize pos = 0;
+  guint lines = 0;
+
+  r->backlog = false;
+  while ( pos < r->in->len ){
+    char *line = r->in->str + pos;
+    char *nl = memchr( line, '\n', r->in->len - pos );
+    char kind[16], addr[NI_MAXHOST];
+    guint64 seq;
+    gint64 usec;
+    double load, capacity;
+    int used;
+
+    if ( nl == NULL )
+      break;
+    if ( ++lines % STREAM_CHECK == 0 && g_get_monotonic_time() >= deadline ) {
+      r->backlog = true;
+      break;
+    }
+    *nl = '\0';
+    pos = nl - r->in->str + 1;
+
+    if ( r->syncing ) {
+      if ( strcmp( line, "!end" ) == 0 ) {
+        sync_end( r );
+      } else if ( r->sync != NULL && fc_decode_line( r->previous, line ) ) {
+        g_string_append_len( r->plain, r->previous->str, r->previous->len );
+        g_string_append_c( r->plain, '\n' );
+        if ( r->plain->len >= REPL_FEED_BYTES )
+          sync_feed( r );
+      }
+    } else if ( sscanf( line, "!seq %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %15s%n", &seq, &usec, kind, &used ) == 3 ) {
+      const char *args = line + used;
+      bool fresh = r->snapshot != NULL || seq > r->applied;
+
+      // Its names follow, it counts once they are in
+      if ( strcmp( kind, "sync" ) == 0 && sscanf( args, "%1024s", addr ) == 1 ) {
+        sync_begin( r, seq, usec, addr, fresh );
+        continue;
+      }
+
+      if ( fresh && strcmp( kind, "renew" ) == 0 && sscanf( args, "%1024s", addr ) == 1 ) {
+        registry_renew( r->reg, addr );
+      } else if ( fresh && strcmp( kind, "load" ) == 0 && sscanf( args, "%1024s %lf %lf", addr, &load, &capacity ) == 3 ) {
+        registry_report( r->reg, addr, load, capacity );
+      } else if ( fresh && strcmp( kind, "drop" ) == 0 && sscanf( args, "%1024s", addr ) == 1 ) {
+        registry_drop( r->reg, addr );
+      }
+      record_applied( r, seq, usec );
+    } else if ( sscanf( line, "!head %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT, &seq, &usec ) == 2 ) {
+      r->head      = seq;
+      r->head_time = usec;
+    } else if ( sscanf( line, "!snapshot %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT, &seq, &usec ) == 2 ) {
+      if ( r->snapshot != NULL )
+        g_hash_table_destroy( r->snapshot );
+      r->snapshot      = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL );
+      r->snapshot_seq  = seq;
+      r->snapshot_time = usec;
+    } else if ( strcmp( line, "!snapshot-end" ) == 0 && r->snapshot != NULL ) {
+      finish_snapshot( r );
+    }
+  }
+
+  sync_feed( r );
+  g_string_erase( r->in, 0, pos );
+}
+
+/*
+ * Reads and applies what the primary sent within the slice of the tick,
+ * and connects again when we lost it. We read while less than
+ * REPL_READ_BUDGET bytes wait to be applied, the primary is held back by
+ * the socket otherwise. Never waits for the primary, a connect goes on
+ * across ticks.
+ *
+ * @param r         the replica
+ * @param deadline  monotonic time the slice ends
+ */
+void repl_replica_run( struct repl_replica *r, gint64 deadline ){
+  gint64 now = g_get_monotonic_time();
+  size_t budget = REPL_READ_BUDGET - MIN( r->in->len, REPL_READ_BUDGET );
+  char chunk[64*1024];
+  ssize_t size = -1;
+
+  if ( r->fd < 0 ) {
+    if ( now < r->next_connect )
+      return;
+    r->next_connect = now + (gint64)REPL_RECONNECT * G_USEC_PER_SEC;
+    replica_connect( r );
+    if ( r->fd < 0 )
+      return;
+  }
+  if ( !r->connected && !replica_connected( r, now ) )
+    return;
+
+  // Not listening is not the primary going silent
+  if ( budget == 0 )
+    r->heard = now;
+
+  errno = EAGAIN;
+  while ( budget > 0 && (size = recv( r->fd, chunk, MIN( budget, sizeof(chunk) ), 0 )) > 0 ) {
+    g_string_append_len( r->in, chunk, size );
+    budget -= size;
+    r->heard = now;
+  }
+
+  apply_records( r, deadline );
+
+  // What it sent before it hung up is applied first
+  if ( (size == 0 && !r->backlog) || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK) )
+    replica_disconnect( r );
+}
+
+/*
+ * @return how much older what we serve is than what the primary has, in
+ *         usec of its clock, 0 when we are caught up
+ */
+gint64 repl_replica_lag( const struct repl_replica *r ){
+  if ( r->applied >= r->head )
+    return 0;
+  return MAX( r->head_time - r->applied_time, 0 );
+}
+
+/*
+ * @return true when the primary we followed went silent for longer than
+ *         REPL_TAKEOVER, it sends a head every REPL_HEAD_INTERVAL
+ */
+bool repl_replica_silent( const struct repl_replica *r, gint64 now ){
+  return r->heard > 0 && now - r->heard >= (gint64)REPL_TAKEOVER * G_USEC_PER_SEC;
+}
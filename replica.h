@@ -0,0 +1,217 @@
+/*
+ * Ships the changes to the registry of a primary publisher to its read
+ * replicas, which serve /where for the same buckets. Only the addresses
+ * the primary was told about with repl_primary_allow() may replicate, a
+ * replica sees every node and every name.
+ *
+ * The primary logs every change as a record with the next sequence
+ * number: a node synced, lease renewals, load reports and nodes that were
+ * dropped. A replica connects to the registration port of the primary,
+ * sends "!replicate <seq>" with the last record it applied and gets every
+ * record after it. When the log no longer goes back that far the replica
+ * gets a snapshot of the whole registry first. Everything is lines:
+ *
+ *   !seq <seq> <usec> sync <addr>           the names the node holds, front
+ *   !end                                    coded, one per line
+ *   !seq <seq> <usec> renew <addr>
+ *   !seq <seq> <usec> load <addr> <load> <capacity>
+ *   !seq <seq> <usec> drop <addr>
+ *   !snapshot <seq> <usec>                  sync records of every node up to
+ *   !snapshot-end
+ *   !head <seq> <usec>                      every REPL_HEAD_INTERVAL
+ *
+ * <usec> is the wall clock of the primary, replicas tell their lag from it.
+ * Sequence numbers start at the wall clock of the primary when it started,
+ * so a restarted primary never reuses them.
+ *
+ * A replica that hears nothing from its primary for REPL_TAKEOVER seconds
+ * stands in for it: it answers /server under the primary's id, so the
+ * ring and the buckets stay where they are and lookups carry on, until
+ * it hears from the primary again.
+ *
+ * Replication costs the primary next to nothing while nobody follows it:
+ * changes only take a sequence number. A sync record only names the node,
+ * its names are streamed out of the registry as the record goes out, a
+ * chunk at a time within the ingest slice, and so are the nodes of a
+ * snapshot. A list that was swapped in the meantime is picked up after
+ * the last name we sent; the record logged for the swap follows anyway.
+ */
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdbool.h>
+#include <netdb.h>
+
+#include <glib.h>
+
+#include "registry.h"
+
+#define REPL_DIRECTIVE     "!replicate"
+
+/* How many bytes of records the primary keeps for replicas that fall behind */
+#define REPL_LOG_BYTES     (64*1024*1024)
+
+/*
+ * Bytes we queue for a replica at once, at least REPL_MIN_BATCH when the
+ * slice is used up
+ */
+#define REPL_BATCH         (1024*1024)
+#define REPL_MIN_BATCH     (16*1024)
+
+/* Seconds we keep logging after the last replica left, it may be back */
+#define REPL_LOG_KEEP      60
+
+/*
+ * Seconds between heads sent to replicas, between reconnects to the
+ * primary and how long a connect may take
+ */
+#define REPL_HEAD_INTERVAL 1
+#define REPL_RECONNECT     1
+#define REPL_CONNECT_TIMEOUT 5
+
+/* Seconds the primary may stay silent before a replica stands in for it */
+#define REPL_TAKEOVER      3
+
+/*
+ * A change to the registry
+ *
+ * @param seq   its sequence number
+ * @param data  the record, as it goes out
+ * @param addr  the node whose names follow a sync record, NULL for others
+ */
+struct repl_record {
+  guint64      seq;
+  GString     *data;
+  char        *addr;
+};
+
+/*
+ * A replica we ship records to
+ *
+ * @param next          sequence number of the next record it needs
+ * @param out           what we queued for it, sent from offset on
+ * @param node          the node whose names we are streaming, "" when we aren't
+ * @param generation    generation of the node's list we streamed from last
+ * @param index         the name of that list we stream next
+ * @param sent          names we streamed of the node so far
+ * @param last          the last name we streamed
+ * @param snapshot      char* addr of the nodes the snapshot still has to
+ *                      stream, NULL when there is no snapshot going out
+ * @param snapshot_seq  the record the snapshot stands for
+ */
+struct repl_peer {
+  int          fd;
+  char         addr[NI_MAXHOST];
+  guint64      next;
+  GString     *out;
+  gsize        offset;
+
+  char         node[NI_MAXHOST];
+  guint64      generation;
+  guint        index;
+  guint        sent;
+  GString     *last;
+
+  GPtrArray   *snapshot;
+  guint64      snapshot_seq;
+};
+
+/*
+ * The primary side
+ *
+ * @param records     struct repl_record, oldest first
+ * @param bytes       what the records take, at most limit
+ * @param head        sequence number of the newest change
+ * @param peers       struct repl_peer
+ * @param allowed     ip addresses replicas may connect from
+ * @param keep_until  monotonic time we stop logging, once nobody follows us
+ * @param snapshots   snapshots we had to send
+ * @param refused     "!replicate" requests from other addresses
+ */
+struct repl_primary {
+  struct registry *reg;
+
+  GQueue       records;
+  gsize        bytes;
+  gsize        limit;
+  guint64      head;
+
+  GPtrArray   *peers;
+  GPtrArray   *allowed;
+  gint64       keep_until;
+  gint64       next_head;
+  unsigned long snapshots;
+  unsigned long refused;
+};
+
+/*
+ * The replica side
+ *
+ * @param primary       "host:port" of the primary
+ * @param fd            the connection to the primary, -1 when there is none
+ * @param connected     connect() went through, until then it is in progress
+ * @param in            what we read and didn't apply yet
+ * @param backlog       the slice ran out before we applied all complete lines of in
+ * @param syncing       the names of a sync record are coming in, up to "!end"
+ * @param sync          the sync they go to, NULL if we had that record already
+ * @param previous      the last name of it we decoded
+ * @param plain         names decoded and not fed yet, one per line
+ * @param applied       last record we applied, and the time it was logged
+ * @param head          newest record the primary told us about, and its time
+ * @param snapshot      nodes in the snapshot coming in, NULL when there is none
+ * @param next_connect  monotonic time we try the primary again
+ * @param connect_deadline  monotonic time we give up on a connect in progress
+ * @param heard         monotonic time we last read from the primary, 0 before we did
+ */
+struct repl_replica {
+  struct registry *reg;
+  char         primary[NI_MAXHOST+8];
+
+  int          fd;
+  bool         connected;
+  GString     *in;
+  bool         backlog;
+
+  bool         syncing;
+  struct reg_sync *sync;
+  guint64      sync_seq;
+  gint64       sync_time;
+  char         sync_addr[NI_MAXHOST];
+  GString     *previous;
+  GString     *plain;
+  GArray      *lines;
+
+  guint64      applied;
+  gint64       applied_time;
+  guint64      head;
+  gint64       head_time;
+
+  GHashTable  *snapshot;
+  guint64      snapshot_seq;
+  gint64       snapshot_time;
+
+  gint64       next_connect;
+  gint64       connect_deadline;
+  gint64       heard;
+  unsigned long records;
+  unsigned long snapshots;
+  unsigned long connects;
+};
+
+void repl_primary_init( struct repl_primary *p, struct registry *reg, gsize limit );
+void repl_primary_clear( struct repl_primary *p );
+void repl_log_sync( struct repl_primary *p, const char *addr );
+void repl_log_renew( struct repl_primary *p, const char *addr );
+void repl_log_load( struct repl_primary *p, const char *addr, double load, double capacity );
+void repl_primary_allow( struct repl_primary *p, const char *addr );
+bool repl_primary_subscribe( struct repl_primary *p, int fd, const char *addr, const char *line );
+guint repl_primary_peers( const struct repl_primary *p, const char *addr );
+void repl_primary_run( struct repl_primary *p, gint64 deadline );
+
+void repl_replica_init( struct repl_replica *r, struct registry *reg, const char *primary );
+void repl_replica_clear( struct repl_replica *r );
+void repl_replica_run( struct repl_replica *r, gint64 deadline );
+gint64 repl_replica_lag( const struct repl_replica *r );
+bool repl_replica_silent( const struct repl_replica *r, gint64 now );
+
+#endif
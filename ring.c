@@ -0,0 +1,411 @@
+/*
+ * Consistent hash ring of publishers, and discovery of its members
+ * through the /server prefix.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+
+#include <ccn/ccn.h>
+#include <ccn/uri.h>
+
+#include <glib.h>
+
+#include "ring.h"
+
+/*
+ * FNV-1a, troute and the publishers have to agree on it
+ *
+ * @param data    bytes to hash
+ * @param length  number of bytes
+ */
+guint32 ring_hash( const void *data, size_t length ){
+  const unsigned char *p = data;
+  guint32 hash = 2166136261u;
+  size_t i;
+
+  for ( i = 0; i < length; ++i ){
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * The bucket a name falls in, the top bits of its hash
+ *
+ * @param name the name
+ */
+guint ring_bucket( const char *name ){
+  return ring_hash( name, strlen( name ) ) >> (32 - RING_BUCKET_BITS);
+}
+
+/*
+ * Orders ids the way ccnb wants Exclude components, shorter ones first
+ */
+static gint compare_ids( gconstpointer a, gconstpointer b ){
+  const char *ia = *(const char * const *)a;
+  const char *ib = *(const char * const *)b;
+  size_t la = strlen( ia ), lb = strlen( ib );
+
+  if ( la != lb )
+    return la < lb ? -1 : 1;
+  return memcmp( ia, ib, la );
+}
+
+static gint compare_points( gconstpointer a, gconstpointer b ){
+  const struct ring_point *pa = a, *pb = b;
+
+  if ( pa->hash != pb->hash )
+    return pa->hash < pb->hash ? -1 : 1;
+  return (gint)pa->member - (gint)pb->member;
+}
+
+struct ring *ring_new( void ){
+  struct ring *ring = g_new0( struct ring, 1 );
+
+  ring->members = g_ptr_array_new_with_free_func( g_free );
+  ring->points  = g_array_new( FALSE, FALSE, sizeof(struct ring_point) );
+  return ring;
+}
+
+void ring_destroy( struct ring *ring ){
+  if ( ring == NULL )
+    return;
+
+  g_ptr_array_free( ring->members, TRUE );
+  g_array_free( ring->points, TRUE );
+  g_free( ring );
+}
+
+/*
+ * Adds a publisher and its virtual nodes to the ring
+ *
+ * @param ring  the ring
+ * @param id    "host:port" of the publisher
+ *
+ * @return false if it already was a member
+ */
+bool ring_add( struct ring *ring, const char *id ){
+  guint i, v;
+
+  for ( i = 0; i < ring->members->len; ++i )
+    if ( strcmp( g_ptr_array_index( ring->members, i ), id ) == 0 )
+      return false;
+
+  g_ptr_array_add( ring->members, g_strdup( id ) );
+  g_ptr_array_sort( ring->members, compare_ids );
+
+  // Member indexes moved, lay out all the points again
+  g_array_set_size( ring->points, 0 );
+  for ( i = 0; i < ring->members->len; ++i ){
+    for ( v = 0; v < RING_VNODES; ++v ){
+      char vnode[NI_MAXHOST + 16];
+      struct ring_point point;
+
+      snprintf( vnode, sizeof(vnode), "%s#%u", (char*)g_ptr_array_index( ring->members, i ), v );
+      point.hash   = ring_hash( vnode, strlen( vnode ) );
+      point.member = i;
+      g_array_append_val( ring->points, point );
+    }
+  }
+  g_array_sort( ring->points, compare_points );
+
+  return true;
+}
+
+/*
+ * @return true if both rings have the same members
+ */
+bool ring_equal( const struct ring *a, const struct ring *b ){
+  guint i;
+
+  if ( a == NULL || b == NULL )
+    return a == b;
+  if ( a->members->len != b->members->len )
+    return false;
+
+  for ( i = 0; i < a->members->len; ++i )
+    if ( strcmp( g_ptr_array_index( a->members, i ), g_ptr_array_index( b->members, i ) ) != 0 )
+      return false;
+  return true;
+}
+
+/*
+ * Finds the publisher owning a bucket
+ *
+ * @param ring    the ring
+ * @param bucket  the bucket, see ring_bucket()
+ *
+ * @return "host:port" of the owner, NULL if the ring is empty
+ */
+const char *ring_owner( const struct ring *ring, guint bucket ){
+  guint32 hash = (guint32)bucket << (32 - RING_BUCKET_BITS);
+  guint lo = 0, hi;
+
+  if ( ring == NULL || ring->points->len == 0 )
+    return NULL;
+
+  // First point at or after the start of the bucket, wrapping around
+  hi = ring->points->len;
+  while ( lo < hi ){
+    guint mid = (lo + hi) / 2;
+    if ( g_array_index( ring->points, struct ring_point, mid ).hash < hash )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if ( lo == ring->points->len )
+    lo = 0;
+
+  return g_ptr_array_index( ring->members, g_array_index( ring->points, struct ring_point, lo ).member );
+}
+
+/*
+ * Expresses the next /server Interest of a round, excluding everybody
+ * we found so far
+ *
+ * @param disc the discovery
+ */
+static void discovery_express( struct ring_discovery *disc ){
+  struct ccn_charbuf *templ = ccn_charbuf_create();
+  unsigned char lifetime[2] = { (DISCOVERY_LIFETIME * 4096) >> 8, (DISCOVERY_LIFETIME * 4096) & 0xff };
+  guint i;
+
+  ccn_charbuf_append_tt(templ, CCN_DTAG_Interest, CCN_DTAG);
+  ccn_charbuf_append_tt(templ, CCN_DTAG_Name, CCN_DTAG);
+  ccn_charbuf_append_closer(templ); /* </Name> */
+
+  if ( disc->next->members->len > 0 ) {
+    ccn_charbuf_append_tt(templ, CCN_DTAG_Exclude, CCN_DTAG);
+    for ( i = 0; i < disc->next->members->len; ++i ){
+      const char *id = g_ptr_array_index( disc->next->members, i );
+      ccnb_append_tagged_blob(templ, CCN_DTAG_Component, id, strlen( id ));
+    }
+    ccn_charbuf_append_closer(templ); /* </Exclude> */
+  }
+
+  ccnb_append_tagged_blob(templ, CCN_DTAG_InterestLifetime, lifetime, sizeof(lifetime));
+  ccn_charbuf_append_closer(templ); /* </Interest> */
+
+  ccn_express_interest( disc->h, disc->prefix, &disc->closure, templ );
+  ccn_charbuf_destroy(&templ);
+}
+
+/*
+ * Spreads a delay over half to one and a half of it, so that nodes that
+ * started together don't keep asking together
+ *
+ * @param delay usec
+ */
+static gint64 jittered( gint64 delay ){
+  return delay / 2 + (gint64)(g_random_double() * delay);
+}
+
+/*
+ * Delay before the next try after failures, doubling up to the interval
+ */
+static gint64 retry_delay( struct ring_discovery *disc ){
+  gint64 delay = (gint64)DISCOVERY_RETRY * G_USEC_PER_SEC << MIN( disc->failures, 16 );
+  return jittered( MIN( delay, (gint64)DISCOVERY_INTERVAL * G_USEC_PER_SEC ) );
+}
+
+/*
+ * A round is over, swap in what we found
+ *
+ * @param disc the discovery
+ */
+static void discovery_finish( struct ring_discovery *disc ){
+  guint found = disc->next->members->len - (disc->self != NULL);
+  gint64 now = g_get_monotonic_time();
+
+  disc->running = false;
+
+  /*
+   * Nobody answered. Clients keep the members they knew, a publisher
+   * going down and a lost round look the same to them, and ask again soon.
+   */
+  if ( found == 0 && disc->self == NULL ) {
+    disc->failures ++;
+    disc->next_round = now + retry_delay( disc );
+    ring_destroy( disc->next );
+    disc->next = NULL;
+    return;
+  }
+
+  disc->failures = 0;
+  disc->next_round = now + jittered( (gint64)DISCOVERY_INTERVAL * G_USEC_PER_SEC );
+
+  if ( ring_equal( disc->ring, disc->next ) ) {
+    ring_destroy( disc->next );
+    disc->next = NULL;
+  } else {
+    ring_destroy( disc->ring );
+    disc->ring = disc->next;
+    disc->next = NULL;
+
+    fprintf( stderr, "Ring : %u publishers\n", disc->ring->members->len );
+    if ( disc->changed != NULL )
+      disc->changed( disc, disc->data );
+  }
+
+  if ( disc->confirmed != NULL )
+    disc->confirmed( disc, disc->data );
+}
+
+/*
+ * Called with every /server answer, the publisher's id is the component
+ * right after the prefix
+ */
+static enum ccn_upcall_res discovery_upcall( struct ccn_closure *selfp,
+    enum ccn_upcall_kind kind, struct ccn_upcall_info *info )
+{
+  struct ring_discovery *disc = selfp->data;
+  const unsigned char *comp;
+  size_t length;
+
+  switch (kind) {
+    case CCN_UPCALL_CONTENT:
+      if ( disc->next == NULL )
+        break;
+
+      if ( ccn_name_comp_get( info->content_ccnb, info->content_comps, disc->prefix_ncomps, &comp, &length ) == 0 ) {
+        char *id = g_strndup( (const char*)comp, length );
+        ring_add( disc->next, id );
+        g_free( id );
+      }
+
+      // Ask again, somebody else may be out there
+      discovery_express( disc );
+      break;
+    case CCN_UPCALL_INTEREST_TIMED_OUT:
+      if ( disc->next != NULL )
+        discovery_finish( disc );
+      break;
+    default:
+      break;
+  }
+
+  return CCN_UPCALL_RESULT_OK;
+}
+
+/*
+ * Sets up discovery, the first round starts with the first discovery_run()
+ *
+ * @param disc           the discovery
+ * @param h              our ccn handle
+ * @param prefix_server  ccnx:/name/prefix/server
+ * @param self           our own "host:port" if we are a publisher, NULL otherwise
+ * @param changed        called whenever the members change
+ * @param data           passed to changed, and to confirmed if it gets set
+ */
+void discovery_init( struct ring_discovery *disc, struct ccn *h, struct ccn_charbuf *prefix_server,
+    const char *self, void (*changed)( struct ring_discovery *, void * ), void *data ){
+  struct ccn_indexbuf *comps = ccn_indexbuf_create();
+
+  memset( disc, 0, sizeof(*disc) );
+  disc->h = h;
+  disc->prefix = prefix_server;
+  disc->prefix_ncomps = ccn_name_split( prefix_server, comps );
+  ccn_indexbuf_destroy( &comps );
+
+  disc->closure.p = &discovery_upcall;
+  disc->closure.data = disc;
+  disc->self = self != NULL ? g_strdup( self ) : NULL;
+  disc->changed = changed;
+  disc->data = data;
+
+  // A publisher always owns something, even before anyone answers
+  if ( disc->self != NULL ) {
+    disc->ring = ring_new();
+    ring_add( disc->ring, disc->self );
+  }
+}
+
+/*
+ * Changes who we are on the ring, a replica takes the place of its
+ * primary while the primary is down. Taking a place counts right away,
+ * leaving it once a round no longer finds us there.
+ *
+ * @param disc  the discovery
+ * @param self  our "host:port" from now on, NULL if we are no member
+ */
+void discovery_set_self( struct ring_discovery *disc, const char *self ){
+  g_free( disc->self );
+  disc->self = self != NULL ? g_strdup( self ) : NULL;
+  if ( disc->self == NULL )
+    return;
+
+  if ( disc->next != NULL )
+    ring_add( disc->next, disc->self );
+  if ( disc->ring == NULL )
+    disc->ring = ring_new();
+  if ( ring_add( disc->ring, disc->self ) ) {
+    fprintf( stderr, "Ring : %u publishers\n", disc->ring->members->len );
+    if ( disc->changed != NULL )
+      disc->changed( disc, disc->data );
+  }
+}
+
+/*
+ * Takes members we already know of, e.g. saved by an earlier run, as the
+ * ring until a round finds otherwise
+ *
+ * @param disc  the discovery
+ * @param ids   "host:port" of the members, NULL terminated
+ */
+void discovery_seed( struct ring_discovery *disc, char **ids ){
+  ring_destroy( disc->ring );
+  disc->ring = ring_new();
+
+  if ( disc->self != NULL )
+    ring_add( disc->ring, disc->self );
+  for ( ; *ids != NULL; ++ids )
+    ring_add( disc->ring, *ids );
+}
+
+/*
+ * Puts the next round off, when what we know is recent enough
+ *
+ * @param disc   the discovery
+ * @param delay  usec from now, spread with jitter
+ */
+void discovery_defer( struct ring_discovery *disc, gint64 delay ){
+  if ( !disc->running )
+    disc->next_round = g_get_monotonic_time() + jittered( delay );
+}
+
+/*
+ * A member didn't answer us, find out who is there sooner than planned,
+ * backing off when it keeps happening
+ *
+ * @param disc the discovery
+ */
+void discovery_retry( struct ring_discovery *disc ){
+  gint64 next;
+
+  if ( disc->running )
+    return;
+
+  next = g_get_monotonic_time() + retry_delay( disc );
+  disc->failures ++;
+  disc->next_round = MIN( disc->next_round, next );
+}
+
+/*
+ * Starts a new round when it is due, call it from the main loop
+ *
+ * @param disc the discovery
+ */
+void discovery_run( struct ring_discovery *disc ){
+  if ( disc->running || g_get_monotonic_time() < disc->next_round )
+    return;
+
+  disc->running = true;
+  disc->next = ring_new();
+  if ( disc->self != NULL )
+    ring_add( disc->next, disc->self );
+
+  discovery_express( disc );
+}
@@ -0,0 +1,94 @@
+/*
+ * Consistent hash ring that splits the name space between publishers.
+ * Names hash into RING_BUCKETS buckets, every bucket belongs to the
+ * publisher owning the first virtual node at or after the bucket on the
+ * ring. Members are found by enumerating the answers to /server.
+ */
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+
+#include <ccn/ccn.h>
+#include <glib.h>
+
+#define RING_BUCKET_BITS  8
+#define RING_BUCKETS      (1 << RING_BUCKET_BITS)
+#define RING_VNODES       64
+#define RING_BUCKET_FORMAT "%02x"
+
+/* How often we enumerate the members again, and how long we wait for each */
+#define DISCOVERY_INTERVAL  30
+#define DISCOVERY_LIFETIME  1
+
+/* First retry after a failed round, doubles with every failure up to DISCOVERY_INTERVAL */
+#define DISCOVERY_RETRY     1
+
+/*
+ * A virtual node on the ring
+ *
+ * @param hash    position on the ring
+ * @param member  index of the publisher in members
+ */
+struct ring_point {
+  guint32      hash;
+  guint        member;
+};
+
+/*
+ * @param members  "host:port" of every publisher, sorted
+ * @param points   struct ring_point, sorted by hash
+ */
+struct ring {
+  GPtrArray   *members;
+  GArray      *points;
+};
+
+/*
+ * Enumerates the publishers answering /server, one Interest per member
+ * excluding the ones we already know, until nobody answers anymore.
+ *
+ * @param ring     members found by the last complete round
+ * @param next     members found so far in the running round
+ * @param self     our own id, when we are a member ourselves
+ * @param changed   called when a round found a different set of members
+ * @param confirmed called after every round that found members, changed or not
+ * @param failures  rounds in a row that found nobody, or members we couldn't reach
+ */
+struct ring_discovery {
+  struct ccn          *h;
+  struct ccn_charbuf  *prefix;
+  int                  prefix_ncomps;
+  struct ccn_closure   closure;
+
+  struct ring         *ring;
+  struct ring         *next;
+  char                *self;
+
+  bool                 running;
+  gint64               next_round;
+  guint                failures;
+
+  void               (*changed)( struct ring_discovery *disc, void *data );
+  void               (*confirmed)( struct ring_discovery *disc, void *data );
+  void                *data;
+};
+
+guint32 ring_hash( const void *data, size_t length );
+guint ring_bucket( const char *name );
+
+struct ring *ring_new( void );
+void ring_destroy( struct ring *ring );
+bool ring_add( struct ring *ring, const char *id );
+bool ring_equal( const struct ring *a, const struct ring *b );
+const char *ring_owner( const struct ring *ring, guint bucket );
+
+void discovery_init( struct ring_discovery *disc, struct ccn *h, struct ccn_charbuf *prefix_server,
+    const char *self, void (*changed)( struct ring_discovery *, void * ), void *data );
+void discovery_run( struct ring_discovery *disc );
+void discovery_set_self( struct ring_discovery *disc, const char *self );
+void discovery_seed( struct ring_discovery *disc, char **ids );
+void discovery_defer( struct ring_discovery *disc, gint64 delay );
+void discovery_retry( struct ring_discovery *disc );
+
+#endif
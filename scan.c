@@ -0,0 +1,124 @@
+/*
+ * Line splitting and hashing for large registrations. The newline search
+ * compares 32 (AVX2) or 16 (SSE2) bytes at a time and walks the match
+ * mask, the hash eats the name 8 bytes at a time. SCAN_SCALAR forces the
+ * plain C path, make check builds and compares all of them.
+ */
+#include <string.h>
+
+#if defined(SCAN_SCALAR)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <glib.h>
+
+#include "scan.h"
+
+/*
+ * Hashes a name a machine word at a time
+ *
+ * @param data    the name
+ * @param length  its length
+ */
+guint64 scan_hash( const char *data, size_t length ){
+  guint64 hash = 0x9e3779b97f4a7c15ull ^ length;
+  guint64 word;
+
+  while ( length >= 8 ){
+    memcpy( &word, data, 8 );
+    hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 32;
+    data   += 8;
+    length -= 8;
+  }
+
+  if ( length > 0 ) {
+    word = 0;
+    memcpy( &word, data, length );
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/*
+ * Terminates a line and adds it, empty lines are skipped
+ */
+static void emit_line( char *buffer, size_t start, size_t end, GArray *lines ){
+  struct scan_line line;
+
+  buffer[end] = '\0';
+  if ( end > start && buffer[end-1] == '\r' )
+    buffer[--end] = '\0';
+  if ( end == start )
+    return;
+
+  line.name   = buffer + start;
+  line.length = end - start;
+  line.hash   = scan_hash( line.name, line.length );
+  g_array_append_val( lines, line );
+}
+
+/*
+ * Splits a buffer into lines, replacing every newline with a NUL
+ *
+ * @param buffer  the payload, buffer[length] must be writable
+ * @param length  bytes in the payload
+ * @param lines   gets a struct scan_line for every non empty line
+ *
+ * @return number of lines added
+ */
+guint scan_lines( char *buffer, size_t length, GArray *lines ){
+  guint before = lines->len;
+  size_t start = 0, i = 0;
+
+#if defined(SCAN_SCALAR)
+#elif defined(__AVX2__)
+  const __m256i newline = _mm256_set1_epi8( '\n' );
+
+  for ( ; i + 32 <= length; i += 32 ){
+    __m256i chunk = _mm256_loadu_si256( (const __m256i*)(buffer + i) );
+    guint32 mask = _mm256_movemask_epi8( _mm256_cmpeq_epi8( chunk, newline ) );
+
+    while ( mask != 0 ){
+      size_t end = i + __builtin_ctz( mask );
+      emit_line( buffer, start, end, lines );
+      start = end + 1;
+      mask &= mask - 1;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8( '\n' );
+
+  for ( ; i + 16 <= length; i += 16 ){
+    __m128i chunk = _mm_loadu_si128( (const __m128i*)(buffer + i) );
+    guint32 mask = _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, newline ) );
+
+    while ( mask != 0 ){
+      size_t end = i + __builtin_ctz( mask );
+      emit_line( buffer, start, end, lines );
+      start = end + 1;
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for ( ; i < length; ++i ){
+    if ( buffer[i] == '\n' ) {
+      emit_line( buffer, start, i, lines );
+      start = i + 1;
+    }
+  }
+
+  // Last line without a newline
+  if ( start < length )
+    emit_line( buffer, start, length, lines );
+
+  return lines->len - before;
+}
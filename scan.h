@@ -0,0 +1,26 @@
+/*
+ * Splits registration payloads into lines and hashes them, SSE2/AVX2
+ * when the compiler targets them, plain C otherwise.
+ */
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <glib.h>
+
+/*
+ * A line of a registration payload
+ *
+ * @param name    the line, NUL terminated in place of its newline
+ * @param length  strlen( name )
+ * @param hash    scan_hash() of the line
+ */
+struct scan_line {
+  char        *name;
+  guint        length;
+  guint64      hash;
+};
+
+guint64 scan_hash( const char *data, size_t length );
+guint scan_lines( char *buffer, size_t length, GArray *lines );
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * Round trips front coded lists: every name comes back from fc_get() and
+ * fc_find() and only matches itself in fc_equal(), fc_iter_next() walks the
+ * list from any index, fc_upper() finds where the names after any name
+ * start, names that aren't there aren't found, on lists around the
+ * FC_RESTART block boundaries and with long shared prefixes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "fcode.h"
+
+#define ROUNDS 300
+
+static int failures = 0;
+
+static int compare_names( const void *a, const void *b ){
+  return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+/*
+ * Random name over a tiny alphabet behind a shared prefix, so neighbours
+ * share a lot and often one is a prefix of the other
+ */
+static char *random_name( void ){
+  static const char *prefixes[] = { "", "ccnx:/repo/", "ccnx:/repo/videos/", "ccnx:/repo/videos/2012/" };
+  char tail[16];
+  int length = 1 + rand() % 8, i;
+
+  for ( i = 0; i < length; ++i )
+    tail[i] = "abc"[rand() % 3];
+  tail[length] = '\0';
+  return g_strdup_printf( "%s%s", prefixes[rand() % 4], tail );
+}
+
+/*
+ * @return count sorted names without duplicates, and how many there are in count
+ */
+static char **random_list( guint *count ){
+  char **names = g_new0( char *, *count + 1 );
+  guint i, unique = 0;
+
+  for ( i = 0; i < *count; ++i )
+    names[i] = random_name();
+  qsort( names, *count, sizeof(char*), compare_names );
+
+  for ( i = 0; i < *count; ++i ){
+    if ( unique > 0 && strcmp( names[unique-1], names[i] ) == 0 )
+      g_free( names[i] );
+    else
+      names[unique++] = names[i];
+  }
+  *count = unique;
+  return names;
+}
+
+static bool in_list( char **names, guint count, const char *name ){
+  return bsearch( &name, names, count, sizeof(char*), compare_names ) != NULL;
+}
+
+/*
+ * @return index of the first name after name
+ */
+static guint upper( char **names, guint count, const char *name ){
+  guint i = 0;
+
+  while ( i < count && strcmp( names[i], name ) <= 0 )
+    ++i;
+  return i;
+}
+
+/*
+ * Builds a list and checks every way of reading it back
+ */
+static void check_list( char **names, guint count ){
+  struct fc_list *list = fc_build( (const char * const *)names, count );
+  GString *name = g_string_new( NULL );
+  GString *line = g_string_new( NULL );
+  GString *previous = g_string_new( NULL );
+  guint i;
+
+  if ( list->count != count || list->blocks->len != (count + FC_RESTART - 1) / FC_RESTART ) {
+    fprintf( stderr, "fc_build: %u names in %u blocks for %u\n", list->count, list->blocks->len, count );
+    failures ++;
+  }
+
+  for ( i = 0; i < count; ++i ){
+    fc_get( list, i, name );
+    if ( strcmp( name->str, names[i] ) != 0 ) {
+      fprintf( stderr, "fc_get: %u of %u is %s, not %s\n", i, count, name->str, names[i] );
+      failures ++;
+    }
+    if ( fc_find( list, names[i] ) != (gint)i ) {
+      fprintf( stderr, "fc_find: %s is at %u of %u, not %d\n", names[i], i, count, fc_find( list, names[i] ) );
+      failures ++;
+    }
+    if ( fc_upper( list, names[i] ) != i + 1 ) {
+      fprintf( stderr, "fc_upper: after %s is %u of %u, not %u\n", names[i], fc_upper( list, names[i] ), count, i + 1 );
+      failures ++;
+    }
+    if ( !fc_equal( list, i, names[i] ) ||
+        (i > 0 && fc_equal( list, i, names[i-1] )) || (i + 1 < count && fc_equal( list, i, names[i+1] )) ) {
+      fprintf( stderr, "fc_equal: %s at %u of %u\n", names[i], i, count );
+      failures ++;
+    }
+
+    // The wire form decodes back too, and restarts every FC_RESTART lines
+    g_string_truncate( line, 0 );
+    fc_encode_line( line, i > 0 ? names[i-1] : NULL, names[i], i );
+    line->str[--line->len] = '\0';
+    if ( (i % FC_RESTART == 0 && strtoul( line->str, NULL, 10 ) != 0) ||
+        !fc_decode_line( previous, line->str ) || strcmp( previous->str, names[i] ) != 0 ) {
+      fprintf( stderr, "fc_encode_line: %s came back as %s\n", names[i], previous->str );
+      failures ++;
+    }
+  }
+
+  // Names that aren't there, before, between and after the ones that are
+  for ( i = 0; i < 4 * count + 4; ++i ){
+    char *probe = i == 0 ? g_strdup( "" ) : i == 1 ? g_strdup( "~" ) : random_name();
+    if ( !in_list( names, count, probe ) && fc_find( list, probe ) != -1 ) {
+      fprintf( stderr, "fc_find: found %s which isn't in a list of %u\n", probe, count );
+      failures ++;
+    }
+    if ( count > 0 && !in_list( names, count, probe ) && fc_equal( list, i % count, probe ) ) {
+      fprintf( stderr, "fc_equal: %s matched %s\n", probe, names[i % count] );
+      failures ++;
+    }
+    if ( fc_upper( list, probe ) != upper( names, count, probe ) ) {
+      fprintf( stderr, "fc_upper: after %s is %u of %u, not %u\n", probe, fc_upper( list, probe ), count,
+          upper( names, count, probe ) );
+      failures ++;
+    }
+    g_free( probe );
+  }
+
+  // From every index to the end
+  for ( i = 0; i <= count; ++i ){
+    struct fc_iter iter;
+    guint j = i;
+
+    fc_iter_init( &iter, list, i, name );
+    while ( fc_iter_next( &iter ) ){
+      if ( j >= count || strcmp( name->str, names[j] ) != 0 ) {
+        fprintf( stderr, "fc_iter_next: %u from %u of %u is %s\n", j, i, count, name->str );
+        failures ++;
+        break;
+      }
+      j ++;
+    }
+    if ( j != count ) {
+      fprintf( stderr, "fc_iter_next: stopped at %u from %u of %u\n", j, i, count );
+      failures ++;
+    }
+  }
+
+  g_string_free( previous, TRUE );
+  g_string_free( line, TRUE );
+  g_string_free( name, TRUE );
+  fc_free( list );
+}
+
+int main( int argc, char **argv ){
+  static const guint sizes[] = { 0, 1, 2, 15, 16, 17, 31, 32, 33, 47, 48, 49, 200 };
+  guint round, i;
+
+  srand( 42 );
+  for ( round = 0; round < ROUNDS; ++round ){
+    guint count = round < G_N_ELEMENTS(sizes) ? sizes[round] : rand() % 300;
+    char **names = random_list( &count );
+
+    check_list( names, count );
+
+    for ( i = 0; i < count; ++i )
+      g_free( names[i] );
+    g_free( names );
+    if ( failures > 10 )
+      break;
+  }
+
+  fprintf( stderr, "test_fcode: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+/*
+ * Registers lists with a registry under a memory budget: once it is full
+ * up to the budget, a node re-sending a list far larger than a socket
+ * buffer still gets all of it in, the least recently renewed nodes are
+ * evicted for it, and registry_room() promises its connection that much.
+ * Answers that differ never share a version. A large sync fed in slices is
+ * indexed by the thread pool.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "registry.h"
+#include "scan.h"
+
+#define BUDGET      (1024*1024)
+#define BIG_LIST    4000
+#define SMALL_LIST  500
+
+static int failures = 0;
+
+#define CHECK( cond ) do { \
+  if ( !(cond) ) { \
+    fprintf( stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond ); \
+    failures ++; \
+  } \
+} while ( 0 )
+
+/*
+ * @return the list of a node, one name per line, as it would come in
+ */
+static GString *node_list( const char *addr, guint count ){
+  GString *text = g_string_new( NULL );
+  guint i;
+
+  for ( i = 0; i < count; ++i )
+    g_string_append_printf( text, "ccnx:/repo/%s/%06u\n", addr, i );
+  return text;
+}
+
+/*
+ * Syncs the list of a node in parts of at most part names, the way
+ * ingest() feeds it, telling the registry how large the list is if
+ * announced
+ */
+static void sync_list( struct registry *reg, const char *addr, guint count, guint part, bool announced ){
+  GString *text = node_list( addr, count );
+  GArray *lines = g_array_new( FALSE, FALSE, sizeof(struct scan_line) );
+  struct reg_sync *sync = registry_sync_begin( reg, addr, announced ? text->len : 0 );
+  guint i;
+
+  scan_lines( text->str, text->len, lines );
+  for ( i = 0; i < lines->len; i += part )
+    registry_sync_feed( sync, &g_array_index( lines, struct scan_line, i ), MIN( part, lines->len - i ) );
+  registry_sync_commit( sync );
+
+  g_array_free( lines, TRUE );
+  g_string_free( text, TRUE );
+}
+
+static void sync_node( struct registry *reg, const char *addr, guint count, guint part ){
+  sync_list( reg, addr, count, part, false );
+}
+
+static guint held( struct registry *reg, const char *addr ){
+  struct reg_node *node = g_hash_table_lookup( reg->nodes, addr );
+  return node != NULL ? node->names->len : 0;
+}
+
+/*
+ * A registry full at its budget takes a re-sync larger than BUF_SIZE
+ */
+static void check_full_resync( void ){
+  struct registry *reg = registry_new( 600, BUDGET );
+  GString *big = node_list( "10.0.0.1", BIG_LIST );
+  struct reg_sync *open;
+  char addr[32];
+  guint i;
+
+  // The big holder goes first, it is the least recently renewed
+  sync_node( reg, "10.0.0.1", BIG_LIST, 1000 );
+  CHECK( held( reg, "10.0.0.1" ) == BIG_LIST );
+
+  // Full up, with less left than the big list takes
+  for ( i = 2; reg->evicted < 2; ++i ){
+    snprintf( addr, sizeof(addr), "10.0.0.%u", i );
+    sync_node( reg, addr, SMALL_LIST, 1000 );
+  }
+  CHECK( reg->bytes <= BUDGET );
+  CHECK( held( reg, "10.0.0.1" ) == 0 );
+
+  // Full, yet the big list fits in what a connection may buffer
+  CHECK( big->len > 64*1024 );
+  CHECK( registry_room( reg, NULL, "10.0.0.1" ) >= big->len );
+  CHECK( reg->budget - reg->bytes < big->len );
+
+  // Nobody else is pinned while a node syncs itself
+  open = registry_sync_begin( reg, "10.0.0.1", 0 );
+  CHECK( registry_room( reg, open, "10.0.0.1" ) == BUDGET );
+  registry_sync_commit( open );
+
+  sync_node( reg, "10.0.0.1", BIG_LIST, 1000 );
+  CHECK( held( reg, "10.0.0.1" ) == BIG_LIST );
+  CHECK( reg->dropped == 0 );
+  CHECK( reg->bytes <= BUDGET );
+  CHECK( registry_lookup( reg, "ccnx:/repo/10.0.0.1/003999" ) != NULL );
+
+  // And again, with the list charged to it already
+  CHECK( reg->budget - reg->bytes < big->len );
+  CHECK( registry_room( reg, NULL, "10.0.0.1" ) >= big->len );
+  sync_node( reg, "10.0.0.1", BIG_LIST, 1000 );
+  CHECK( held( reg, "10.0.0.1" ) == BIG_LIST );
+  CHECK( reg->dropped == 0 );
+
+  // The node being ingested can't be evicted, it is all the others get
+  open = registry_sync_begin( reg, "10.0.0.1", 0 );
+  CHECK( registry_room( reg, open, "10.0.0.2" ) == BUDGET - open->node->bytes );
+  registry_sync_commit( open );
+
+  g_string_free( big, TRUE );
+  registry_destroy( reg );
+}
+
+/*
+ * The version of a name moves with its holders and with every answer that
+ * says something else, and only then
+ */
+static void check_versions( void ){
+  struct registry *reg = registry_new( 600, 0 );
+  struct reg_name *entry;
+  struct reg_node *node;
+  guint64 version, epoch;
+
+  sync_node( reg, "10.0.0.1", 10, 10 );
+  sync_node( reg, "10.0.0.2", 10, 10 );
+  entry = registry_lookup( reg, "ccnx:/repo/10.0.0.1/000001" );
+  CHECK( entry != NULL );
+  version = entry->version;
+
+  // The first answer under a version settles it, the same one keeps it
+  CHECK( registry_answered( entry, 1 ) == version );
+  CHECK( registry_answered( entry, 1 ) == version );
+
+  // Reranked, or a holder gone before it is reclaimed
+  CHECK( registry_answered( entry, 2 ) > version );
+  version = entry->version;
+  CHECK( registry_answered( entry, 2 ) == version );
+
+  node  = g_hash_table_lookup( reg->nodes, "10.0.0.1" );
+  epoch = reg->load_epoch;
+  registry_report( reg, "10.0.0.1", 2, 4 );
+  CHECK( node->load_epoch > epoch );
+  epoch = node->load_epoch;
+  registry_drop( reg, "10.0.0.1" );
+  CHECK( node->expired && node->load_epoch > epoch );
+
+  // Holders that come anew start a version of their own
+  sync_node( reg, "10.0.0.1", 10, 10 );
+  entry = registry_lookup( reg, "ccnx:/repo/10.0.0.1/000001" );
+  CHECK( entry != NULL && entry->version > version );
+  version = entry->version;
+  CHECK( registry_answered( entry, 3 ) == version );
+
+  registry_destroy( reg );
+}
+
+/*
+ * The pool takes the parts of a large sync, however small the slices it
+ * comes in, and leaves small syncs alone
+ */
+static void check_parallel( void ){
+  struct registry *reg = registry_new( 600, 0 );
+  unsigned long before;
+
+  sync_list( reg, "10.0.0.1", 20000, 8192, false );
+  CHECK( reg->parallel == 0 );
+
+  // Announced large, every part of REG_PARALLEL_PART or more goes to the pool
+  sync_list( reg, "10.0.0.2", 100000, 8192, true );
+  CHECK( reg->parallel == 100000 / 8192 );
+  CHECK( held( reg, "10.0.0.2" ) == 100000 );
+
+  // Not announced, the parts after the first REG_PARALLEL_MIN names do
+  before = reg->parallel;
+  sync_list( reg, "10.0.0.3", 100000, 8192, false );
+  CHECK( reg->parallel > before );
+  CHECK( held( reg, "10.0.0.3" ) == 100000 );
+  CHECK( registry_lookup( reg, "ccnx:/repo/10.0.0.3/099999" ) != NULL );
+  CHECK( reg->name_count == 220000 );
+
+  registry_destroy( reg );
+}
+
+int main( int argc, char **argv ){
+  check_full_resync();
+  check_versions();
+  check_parallel();
+
+  fprintf( stderr, "test_registry: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
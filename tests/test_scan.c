@@ -0,0 +1,128 @@
+/*
+ * Runs the AVX2, SSE2 and plain C builds of scan.c over random buffers
+ * and checks them against a simple splitter and against each other.
+ * Lines cross the 16 and 32 byte boundaries the SIMD loops work in.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "scan.h"
+
+#define ROUNDS     20000
+#define MAX_LENGTH 200
+
+typedef guint (*scan_fn)( char *buffer, size_t length, GArray *lines );
+typedef guint64 (*hash_fn)( const char *data, size_t length );
+
+guint scan_lines_scalar( char *buffer, size_t length, GArray *lines );
+guint scan_lines_sse2( char *buffer, size_t length, GArray *lines );
+guint scan_lines_avx2( char *buffer, size_t length, GArray *lines );
+guint64 scan_hash_scalar( const char *data, size_t length );
+guint64 scan_hash_sse2( const char *data, size_t length );
+guint64 scan_hash_avx2( const char *data, size_t length );
+
+static int failures = 0;
+
+/*
+ * Splits the way scan_lines() is documented to: on '\n', dropping a '\r'
+ * before it and empty lines
+ *
+ * @return offset and length of every line, two guints each
+ */
+static GArray *reference( const char *buffer, size_t length ){
+  GArray *expected = g_array_new( FALSE, FALSE, sizeof(guint) );
+  size_t start = 0, i;
+
+  for ( i = 0; i <= length; ++i ){
+    guint offset, size;
+
+    if ( i < length && buffer[i] != '\n' )
+      continue;
+    offset = start;
+    size = i - start;
+    if ( size > 0 && buffer[i-1] == '\r' )
+      size --;
+    if ( size > 0 ) {
+      g_array_append_val( expected, offset );
+      g_array_append_val( expected, size );
+    }
+    start = i + 1;
+  }
+
+  return expected;
+}
+
+/*
+ * Runs one build of scan_lines() on a copy of the buffer and compares
+ */
+static void check( const char *what, scan_fn scan, hash_fn hash, const char *buffer, size_t length,
+    GArray *expected ){
+  char *copy = g_malloc( length + 1 );
+  GArray *lines = g_array_new( FALSE, FALSE, sizeof(struct scan_line) );
+  guint i, count;
+
+  memcpy( copy, buffer, length );
+  count = scan( copy, length, lines );
+
+  if ( count != expected->len / 2 || lines->len != count ) {
+    fprintf( stderr, "%s: %u lines instead of %u in a %zu byte buffer\n", what, count, expected->len / 2, length );
+    failures ++;
+  }
+
+  for ( i = 0; i < count && i < expected->len / 2; ++i ){
+    struct scan_line *line = &g_array_index( lines, struct scan_line, i );
+    guint offset = g_array_index( expected, guint, 2 * i );
+    guint size = g_array_index( expected, guint, 2 * i + 1 );
+
+    if ( line->name != copy + offset || line->length != size || line->name[size] != '\0' ||
+        memcmp( line->name, buffer + offset, size ) != 0 ||
+        line->hash != hash( buffer + offset, size ) || line->hash != scan_hash_scalar( buffer + offset, size ) ) {
+      fprintf( stderr, "%s: line %u of a %zu byte buffer differs\n", what, i, length );
+      failures ++;
+      break;
+    }
+  }
+
+  g_array_free( lines, TRUE );
+  g_free( copy );
+}
+
+int main( int argc, char **argv ){
+  const char alphabet[] = "ab\n\n\r";
+  bool avx2;
+  guint round;
+
+  __builtin_cpu_init();
+  avx2 = __builtin_cpu_supports( "avx2" );
+  if ( !avx2 )
+    fprintf( stderr, "test_scan: no AVX2 here, skipping that build\n" );
+
+  srand( 42 );
+  for ( round = 0; round < ROUNDS; ++round ){
+    size_t length = rand() % (MAX_LENGTH + 1), i;
+    char *buffer = g_malloc( length + 1 );
+    GArray *expected;
+
+    // Every few rounds long lines only, so they span whole SIMD blocks
+    for ( i = 0; i < length; ++i )
+      buffer[i] = round % 4 == 0 && rand() % 40 != 0 ? 'x' : alphabet[rand() % (sizeof(alphabet) - 1)];
+
+    expected = reference( buffer, length );
+    check( "scalar", scan_lines_scalar, scan_hash_scalar, buffer, length, expected );
+    check( "sse2", scan_lines_sse2, scan_hash_sse2, buffer, length, expected );
+    if ( avx2 )
+      check( "avx2", scan_lines_avx2, scan_hash_avx2, buffer, length, expected );
+
+    g_array_free( expected, TRUE );
+    g_free( buffer );
+    if ( failures > 10 )
+      break;
+  }
+
+  fprintf( stderr, "test_scan: %s\n", failures == 0 ? "ok" : "FAILED" );
+  return failures == 0 ? 0 : 1;
+}
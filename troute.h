@@ -0,0 +1,108 @@
+/*
+ * libtroute, resolves where names are held through the /where publishers
+ * and registers the names of our own repository with them.
+ *
+ * Nothing blocks on the network: poll() the descriptors troute_fds() gives
+ * you along with your own and call troute_process() whenever one of them
+ * is ready or the timeout it returned ran out. Callbacks run from
+ * troute_process().
+ */
+#ifndef TROUTE_H
+#define TROUTE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <poll.h>
+
+#include <ccn/ccn.h>
+#include <glib.h>
+
+#include "ring.h"
+
+#define TROUTE_SERVER_SUFFIX "server"
+#define TROUTE_WHERE_SUFFIX  "where"
+
+/* How long troute_process() lets you wait at most, in ms */
+#define TROUTE_MAX_WAIT 100
+
+/* Seconds a registration may make no progress before we give up on the publisher */
+#define TROUTE_SEND_TIMEOUT 30
+
+/* Seconds before we run a names command again that failed */
+#define TROUTE_NAMES_RETRY  10
+
+/* Saved publishers younger than this (seconds) are trusted without asking */
+#define TROUTE_CACHE_FRESH 3600
+
+enum troute_status {
+  TROUTE_OK,
+  TROUTE_TIMEOUT
+};
+
+struct troute;
+
+/*
+ * Called once for every lookup
+ *
+ * @param tr       the handle
+ * @param status   TROUTE_OK, or TROUTE_TIMEOUT if no publisher answered
+ * @param name     the name we looked up
+ * @param holders  "ip" of the holders, best first, NULL terminated
+ * @param count    number of holders, 0 if nobody holds the name
+ * @param data     what was passed to troute_lookup()
+ */
+typedef void (*troute_callback)( struct troute *tr, enum troute_status status, const char *name,
+    char **holders, guint count, void *data );
+
+/*
+ * A resolver
+ *
+ * @param discovery       the publishers sharing the name space
+ * @param names_command   prints the names we register, NULL to only look up
+ * @param resync          the ring changed, everybody gets their share again
+ * @param lease           lease the publishers gave us, renewed with heartbeats
+ * @param cache_path      where we save the publishers we know, NULL for nowhere
+ * @param sends           registrations and heartbeats on their way, one per publisher
+ * @param names_pipe      the names command while it runs
+ * @param names_read      what it printed so far, NULL when it isn't running
+ * @param names_pending   "host:port" of publishers waiting for our names
+ * @param names_everybody every publisher on the ring is waiting for them
+ * @param names_retry     monotonic time we may run the command again after it failed
+ */
+struct troute {
+  struct ccn           *ccn;
+  struct ccn_charbuf   *prefix_server;
+  struct ccn_charbuf   *prefix_where;
+  struct ccn_charbuf   *template_where;
+  struct ring_discovery discovery;
+
+  char                 *names_command;
+  bool                  resync;
+
+  int                   lease;
+  gint64                next_heartbeat;
+
+  char                 *cache_path;
+
+  GPtrArray            *sends;
+  FILE                 *names_pipe;
+  GString              *names_read;
+  GPtrArray            *names_pending;
+  bool                  names_everybody;
+  gint64                names_retry;
+};
+
+struct troute *troute_new( const char *prefix );
+void troute_destroy( struct troute *tr );
+void troute_set_names_command( struct troute *tr, const char *command );
+bool troute_set_cache( struct troute *tr, const char *path );
+
+int troute_fd( struct troute *tr );
+guint troute_fds( struct troute *tr, struct pollfd *fds, guint size );
+int troute_process( struct troute *tr );
+
+void troute_lookup( struct troute *tr, const char *name, troute_callback callback, void *data );
+void troute_lookup_batch( struct troute *tr, const char * const *names, guint count,
+    troute_callback callback, void *data );
+
+#endif